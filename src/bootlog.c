@@ -0,0 +1,315 @@
+/*
+ * Boot-time working-set replay.
+ *
+ * The first boot of a guest image records the line of every cache miss to
+ * a log in flash, right after the guest RAM. Later boots of the same image
+ * replay the log as a prefetch stream that runs a little ahead of the
+ * guest, so the cold misses of the boot are served by batched psram reads
+ * of consecutive lines instead of one read per line.
+ *
+ * A recording ends after BOOTLOG_WINDOW_S seconds of guest execution, when
+ * the log is full, when the guest writes 8 to CSR 0x13a, or when it powers
+ * off or restarts, whichever comes first. Only then is the header written,
+ * so a boot cut short by a power cycle is recorded again next time.
+ * Entries are buffered in RAM by the miss hook and written to flash between
+ * two slices of guest execution, never in the middle of a cache fill.
+ *
+ * The log is a header page followed by the lines as zigzag varint deltas
+ * to the previous one, a byte or two per miss for the mostly sequential
+ * boot traffic.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "esp_flash.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "bootlog.h"
+#include "cache.h"
+
+#define TAG "bootlog"
+
+/* after the 8 MiB of guest RAM at 0x200000, see psram.c */
+#define BOOTLOG_FLASH_OFFSET	0xa00000
+#define BOOTLOG_SIZE		(256 * 1024)
+#define BOOTLOG_SECTOR		4096
+#define BOOTLOG_PAGE		256
+#define BOOTLOG_MAGIC		0x474c5442	/* "BTLG" */
+
+/* recorded boot, in seconds of guest execution */
+#ifndef BOOTLOG_WINDOW_S
+#define BOOTLOG_WINDOW_S	120
+#endif
+/* entries buffered between two flash writes, a multiple of BOOTLOG_PAGE */
+#define BOOTLOG_RING		(16 * BOOTLOG_PAGE)
+
+/* how far the replay runs ahead of the guest, in log entries */
+#define BOOTLOG_DISTANCE	64
+/* lines prefetched per emulator slice at most */
+#define BOOTLOG_BURST		32
+
+struct bootlog_header {
+	uint32_t magic;
+	uint32_t image_hash;
+	uint32_t entries;	/* misses recorded */
+	uint32_t bytes;		/* of entries, after the header page */
+	uint32_t duration_us;	/* from boot to the last miss, flash writes excluded */
+	uint32_t line_shift;	/* CACHE_LINE_SHIFT of the recording */
+};
+
+enum {
+	BOOTLOG_IDLE,
+	BOOTLOG_RECORD,
+	BOOTLOG_REPLAY,
+};
+
+static int mode;
+static struct bootlog_header hdr;
+static uint8_t buf[BOOTLOG_PAGE];
+static uint32_t buf_pos, buf_len;	/* next byte of buf, bytes in buf */
+static uint32_t log_pos;		/* bytes of entries written or read */
+static uint8_t ring[BOOTLOG_RING];
+static uint32_t ring_head, ring_tail;	/* bytes of entries recorded, written */
+static int log_full;
+static uint32_t last_line;
+static uint32_t progress;		/* entries the guest went past */
+static uint32_t cursor;			/* entries queued for prefetch */
+static int64_t start_us, io_us;
+
+/*
+ * Hash the image as stored in flash, read directly rather than through the
+ * cache so that dirty lines of a previous run don't take part.
+ */
+static uint32_t bootlog_image_hash(uint32_t flash_ofs, uint32_t len)
+{
+	uint32_t ofs, n, h = 2166136261u ^ len;
+	int i;
+
+	for (ofs = 0; ofs < len; ofs += n) {
+		n = len - ofs < sizeof(buf) ? len - ofs : sizeof(buf);
+		esp_flash_read(NULL, buf, flash_ofs + ofs, n);
+		for (i = 0; i < n; i++)
+			h = (h ^ buf[i]) * 16777619u;
+	}
+	return h;
+}
+
+/*
+ * Write the buffered entries to the log, erasing sectors as they are
+ * reached. Only whole pages are written unless @all is set.
+ */
+static void bootlog_flush(int all)
+{
+	uint32_t addr, n;
+	int64_t t = esp_timer_get_time();
+
+	while (ring_head - ring_tail >= (all ? 1 : BOOTLOG_PAGE)) {
+		addr = BOOTLOG_FLASH_OFFSET + BOOTLOG_PAGE + ring_tail;
+		n = ring_head - ring_tail < BOOTLOG_PAGE ? ring_head - ring_tail : BOOTLOG_PAGE;
+		if (addr % BOOTLOG_SECTOR == 0)
+			esp_flash_erase_region(NULL, addr, BOOTLOG_SECTOR);
+		esp_flash_write(NULL, ring + ring_tail % BOOTLOG_RING, addr, n);
+		ring_tail += n;
+	}
+	io_us += esp_timer_get_time() - t;
+}
+
+/* The miss hook, only buffers the entry. */
+static void bootlog_record(uint32_t ofs, int type)
+{
+	uint32_t line = ofs >> CACHE_LINE_SHIFT;
+	int32_t d = line - last_line;
+	uint32_t z = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+	uint8_t e[5];
+	int n = 0, i;
+
+	if (log_full)
+		return;
+	for (; z >= 0x80; z >>= 7)
+		e[n++] = z | 0x80;
+	e[n++] = z;
+	/* out of flash, or of buffer until the next slice */
+	if (BOOTLOG_PAGE + ring_head + n > BOOTLOG_SIZE ||
+	    ring_head - ring_tail + n > BOOTLOG_RING) {
+		log_full = 1;
+		return;
+	}
+	for (i = 0; i < n; i++)
+		ring[ring_head++ % BOOTLOG_RING] = e[i];
+	last_line = line;
+	hdr.entries++;
+	hdr.duration_us = esp_timer_get_time() - start_us - io_us;
+}
+
+/* Decode the next entry of the log, returns -1 at its end. */
+static int bootlog_next(uint32_t *line)
+{
+	uint32_t z = 0, n;
+	int shift = 0;
+	uint8_t b;
+
+	do {
+		if (buf_pos == buf_len) {
+			if (log_pos >= hdr.bytes)
+				return -1;
+			n = hdr.bytes - log_pos < sizeof(buf) ? hdr.bytes - log_pos : sizeof(buf);
+			esp_flash_read(NULL, buf, BOOTLOG_FLASH_OFFSET + BOOTLOG_PAGE + log_pos, n);
+			log_pos += n;
+			buf_pos = 0;
+			buf_len = n;
+		}
+		b = buf[buf_pos++];
+		z |= (uint32_t)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	last_line += (int32_t)((z >> 1) ^ -(z & 1));
+	*line = last_line;
+	return 0;
+}
+
+/* Both demand misses and first uses of prefetched lines move the guest on. */
+static void bootlog_replay(uint32_t ofs, int type)
+{
+	progress++;
+}
+
+static void bootlog_report(void)
+{
+	struct cache_stats st;
+	int64_t elapsed = esp_timer_get_time() - start_us;
+	uint64_t filled;
+
+	cache_stats_snapshot(&st);
+	filled = st.misses[CACHE_PREFETCH];
+	ESP_LOGI(TAG, "replayed %"PRIu32"/%"PRIu32" misses in %"PRId64" ms, recorded boot took %"PRIu32" ms",
+		 progress < hdr.entries ? progress : hdr.entries, hdr.entries,
+		 elapsed / 1000, hdr.duration_us / 1000);
+	if (progress >= hdr.entries && hdr.duration_us)
+		ESP_LOGI(TAG, "boot time %+"PRId64"%% against the recording",
+			 (elapsed - (int64_t)hdr.duration_us) * 100 / hdr.duration_us);
+	ESP_LOGI(TAG, "prefetch accuracy: %llu of %llu lines used (%llu%%), %llu evicted unused, %llu reads",
+		 st.prefetch_useful, filled, filled ? st.prefetch_useful * 100 / filled : 0,
+		 st.prefetch_unused, st.prefetch_ios);
+}
+
+/*
+ * Called at every (re)start of the guest with the flash range of its image:
+ * replay the log if it was recorded from this image, record a new one
+ * otherwise.
+ */
+void bootlog_start(uint32_t image_ofs, uint32_t image_len)
+{
+	uint32_t hash;
+
+	bootlog_finish();
+	if (!BOOTLOG)
+		return;
+
+	hash = bootlog_image_hash(image_ofs, image_len);
+	esp_flash_read(NULL, &hdr, BOOTLOG_FLASH_OFFSET, sizeof(hdr));
+	buf_pos = buf_len = log_pos = 0;
+	ring_head = ring_tail = 0;
+	log_full = 0;
+	last_line = progress = cursor = 0;
+	io_us = 0;
+
+	if (hdr.magic == BOOTLOG_MAGIC && hdr.image_hash == hash &&
+	    hdr.line_shift == CACHE_LINE_SHIFT && hdr.entries) {
+		ESP_LOGI(TAG, "replaying %"PRIu32" boot misses", hdr.entries);
+		mode = BOOTLOG_REPLAY;
+		cache_set_miss_hook(bootlog_replay);
+		start_us = esp_timer_get_time();
+		/* have the first lines on the way before the guest runs */
+		bootlog_tick();
+		return;
+	}
+
+	esp_flash_erase_region(NULL, BOOTLOG_FLASH_OFFSET, BOOTLOG_SECTOR);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.image_hash = hash;
+	hdr.line_shift = CACHE_LINE_SHIFT;
+	ESP_LOGI(TAG, "recording boot misses");
+	mode = BOOTLOG_RECORD;
+	cache_set_miss_hook(bootlog_record);
+	start_us = esp_timer_get_time();
+}
+
+/*
+ * Called between two slices of guest execution: write out the recorded
+ * entries and end the recording when it is due, or keep the prefetch queue
+ * up to BOOTLOG_DISTANCE entries ahead of where the guest is in the log.
+ */
+void bootlog_tick(void)
+{
+	uint32_t line;
+	int n;
+
+	if (mode == BOOTLOG_RECORD) {
+		bootlog_flush(0);
+		if (log_full || esp_timer_get_time() - start_us - io_us >= BOOTLOG_WINDOW_S * 1000000ll)
+			bootlog_finish();
+		return;
+	}
+	if (mode != BOOTLOG_REPLAY)
+		return;
+
+	/* entries the guest went past without the prefetcher are stale */
+	for (; cursor < progress; cursor++) {
+		if (bootlog_next(&line))
+			goto done;
+	}
+	for (n = 0; n < BOOTLOG_BURST && cursor < progress + BOOTLOG_DISTANCE; n++) {
+		if (bootlog_next(&line))
+			break;
+		cache_prefetch(line << CACHE_LINE_SHIFT);
+		cursor++;
+	}
+	cache_prefetch_drain(BOOTLOG_BURST);
+
+	if (cursor < hdr.entries || progress < hdr.entries)
+		return;
+done:
+	bootlog_finish();
+}
+
+/*
+ * Stop recording or replaying, writing out the rest of the log and its
+ * header when recording.
+ */
+void bootlog_finish(void)
+{
+	switch (mode) {
+	case BOOTLOG_RECORD:
+		cache_set_miss_hook(NULL);
+		bootlog_flush(1);
+		hdr.bytes = ring_tail;
+		hdr.magic = BOOTLOG_MAGIC;
+		esp_flash_write(NULL, &hdr, BOOTLOG_FLASH_OFFSET, sizeof(hdr));
+		ESP_LOGI(TAG, "recorded %"PRIu32" boot misses in %"PRIu32" bytes over %"PRIu32" ms",
+			 hdr.entries, hdr.bytes, hdr.duration_us / 1000);
+		break;
+	case BOOTLOG_REPLAY:
+		cache_set_miss_hook(NULL);
+		bootlog_report();
+		break;
+	}
+	mode = BOOTLOG_IDLE;
+}
+
+/* Forget the recorded boot, the next one records a new log. */
+void bootlog_discard(void)
+{
+	if (!BOOTLOG)
+		return;
+	if (mode == BOOTLOG_RECORD) {
+		cache_set_miss_hook(NULL);
+		mode = BOOTLOG_IDLE;
+	}
+	esp_flash_erase_region(NULL, BOOTLOG_FLASH_OFFSET, BOOTLOG_SECTOR);
+}
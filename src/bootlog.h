@@ -0,0 +1,23 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef BOOTLOG_H
+#define BOOTLOG_H
+
+#include <stdint.h>
+
+/*
+ * Record the first boot of an image, pre-warm the cache on later ones.
+ * Experimental, and the recording writes to flash.
+ */
+#ifndef BOOTLOG
+#define BOOTLOG		0
+#endif
+
+void bootlog_start(uint32_t image_ofs, uint32_t image_len);
+void bootlog_tick(void);
+void bootlog_finish(void);
+void bootlog_discard(void);
+
+#endif /* BOOTLOG_H */
@@ -5,145 +5,1546 @@
  */
 
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "cache.h"
 #include "psram.h"
 
+#ifdef ESP_PLATFORM
+#include "esp_cpu.h"
+#define cache_clock()	esp_cpu_get_cycle_count()
+#else
+#include <time.h>
+static inline uint32_t cache_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+/*
+ * Sort misses into compulsory, conflict and capacity ones, with a bitmap of
+ * the lines ever touched and a fully associative shadow. The bitmap is four
+ * times the size of the cache and every access updates the shadow, so it is
+ * for tools/cachesim rather than the device.
+ */
+#ifndef CACHE_STATS_3C
+#define CACHE_STATS_3C		0
+#endif
+
+/* allocate lines on a write miss without reading them from psram */
+#ifndef CACHE_WRITE_VALIDATE
+#define CACHE_WRITE_VALIDATE	1
+#endif
+
+/* keep a reference bit per page of guest RAM, see cache_collect_refs() */
+#ifndef CACHE_PAGE_REFS
+#define CACHE_PAGE_REFS		1
+#endif
+
+/*
+ * Attribute demand misses and the writebacks they cause to the guest PC
+ * in cache_pc, in a table of PC_SLOTS entries. A PC finding no free entry
+ * among the PC_PROBE it hashes to takes over the one with the fewest
+ * events, and its count (space-saving), so that the heavy hitters stay.
+ */
+#ifndef CACHE_PC_PROFILE
+#define CACHE_PC_PROFILE	1
+#endif
+#define PC_SLOTS		128
+#define PC_PROBE		8
+
+/*
+ * Send long sequential runs of data misses through a tiny write-combining
+ * buffer instead of the cache. The buffer is one extra set, STREAM_SET.
+ */
+#ifndef CACHE_STREAM
+#define CACHE_STREAM		1
+#endif
+#define STREAM_SET		CACHE_SETS
+#define STREAM_ENTRIES		4	/* sequential runs tracked at once */
+#define STREAM_THRESHOLD	8	/* lines in a row before bypassing */
+
+#define CACHE_LINES		(CACHE_SETS * CACHE_WAYS)
+#define NR_SETS			(CACHE_SETS + CACHE_STREAM)
+
+/*
+ * Set index function: the plain index bits, those XORed with higher line
+ * address bits so that power of two strides spread over the sets, or a
+ * different such hash per way (skewed associativity).
+ */
+#define CACHE_INDEX_PLAIN	0
+#define CACHE_INDEX_XOR		1
+#define CACHE_INDEX_SKEW	2
+#ifndef CACHE_INDEX
+#define CACHE_INDEX		CACHE_INDEX_PLAIN
+#endif
+#define SET_BITS		__builtin_ctz(CACHE_SETS)
+
+/* pinned ranges, at most a quarter of the cache and one way per set */
+#define CACHE_PIN_RANGES	8
+#define CACHE_PIN_MAX_LINES	(CACHE_LINES / 4)
+#define LINE_OFS		(CACHE_LINE_SIZE - 1)
+
+/* 2-bit re-reference prediction values, RRPV_MAX is "reused far away" */
+#define RRPV_MAX		3
+/* BIP and BRRIP insert the other way once every BIMODAL_THROTTLE fills */
+#define BIMODAL_THROTTLE	32
+
+/*
+ * Set dueling: in every group of DUEL_GROUP sets, one leader set always
+ * uses each candidate policy. The other sets follow the candidate whose
+ * leaders missed least, re-elected every DUEL_PERIOD leader misses.
+ */
+#define DUEL_CANDIDATES		4
+#define DUEL_GROUP		(CACHE_SETS < 16 ? CACHE_SETS : 16)
+#define DUEL_PERIOD		256
+
+/* lines the range iterator and the prefetcher read from psram at once */
+#define RANGE_BATCH		(CACHE_SETS < 8 ? CACHE_SETS : 8)
+
+/* lines waiting in the prefetch queue at most, a power of two */
+#define PREFETCH_QUEUE		32
+
+#if CACHE_LINE_SHIFT < 4
+#error "the tag flags need lines of at least 16 bytes"
+#endif
+#define LINE_MSK		(~(uint32_t)LINE_OFS)
+
 struct cacheline {
-	uint8_t data[64];
+	uint8_t data[CACHE_LINE_SIZE];
+};
+
+static struct cache_stats stats;
+uint8_t cache_regions[CACHE_BACKING_SIZE >> CACHE_REGION_SHIFT];
+static uint8_t page_refs[CACHE_PAGES / 8];
+#if CACHE_STATS_3C
+static uint32_t seen[CACHE_BACKING_SIZE / CACHE_LINE_SIZE / 32];
+#endif
+static uint32_t tags[NR_SETS][CACHE_WAYS];
+static uint32_t stamp[NR_SETS][CACHE_WAYS];
+static uint8_t rrpv[NR_SETS][CACHE_WAYS];
+static struct cacheline cachelines[NR_SETS][CACHE_WAYS];
+#if CACHE_WRITE_VALIDATE
+static uint64_t vmask[NR_SETS][CACHE_WAYS];
+#endif
+static uint32_t tick, rnd = 0x2545f491;
+static int policy = CACHE_POLICY_LRU;
+
+uint32_t cache_pc;
+#if CACHE_PC_PROFILE
+static struct cache_pc_stat pc_table[PC_SLOTS];
+#endif
+
+static uint32_t pf_queue[PREFETCH_QUEUE];	/* line addresses */
+static unsigned int pf_head, pf_tail;
+static cache_miss_fn miss_hook;
+
+static const uint8_t duel_candidates[DUEL_CANDIDATES] = {
+	CACHE_POLICY_LRU, CACHE_POLICY_BIP, CACHE_POLICY_SRRIP, CACHE_POLICY_BRRIP,
 };
+static uint32_t duel_misses[DUEL_CANDIDATES], duel_count;
+static int duel_winner;
 
-static uint64_t accessed, hit;
-static uint32_t tags[4096/64/2][2];
-static struct cacheline cachelines[4096/64/2][2];
+static struct {
+	uint32_t first, last;	/* line numbers */
+} pins[CACHE_PIN_RANGES];
+static int nr_pins;
+static uint32_t pinned_lines;
+
+static const char *const policy_names[CACHE_NR_POLICIES] = {
+	[CACHE_POLICY_LRU]	= "lru",
+	[CACHE_POLICY_FIFO]	= "fifo",
+	[CACHE_POLICY_RANDOM]	= "random",
+	[CACHE_POLICY_LIP]	= "lip",
+	[CACHE_POLICY_BIP]	= "bip",
+	[CACHE_POLICY_SRRIP]	= "srrip",
+	[CACHE_POLICY_BRRIP]	= "brrip",
+	[CACHE_POLICY_DUEL]	= "duel",
+};
 
 /*
  * bit[0]: valid
  * bit[1]: dirty
- * bit[2]: for LRU
- * bit[3:10]: reserved
- * bit[11:31]: tag
+ * bit[2]: locked, never picked for eviction
+ * bit[3]: prefetched and not used yet
+ * bit[4:CACHE_LINE_SHIFT-1]: reserved
+ * bit[CACHE_LINE_SHIFT:31]: line address
+ *
+ * stamp[][] holds the tick of the last use (LRU) or of the fill (FIFO).
+ * rrpv[][] is only used by the RRIP policies, but both are kept up to date
+ * under every policy except FIFO so that dueling sets can switch freely.
+ *
+ * With CACHE_WRITE_VALIDATE, vmask[][] has a bit per byte (per 1/64th of
+ * the line for lines over 64 bytes) that holds valid data. Only lines
+ * allocated by a write miss are partially valid, and those are always
+ * dirty.
  */
 #define VALID		(1 << 0)
 #define DIRTY		(1 << 1)
-#define LRU		(1 << 2)
-#define LRU_SFT		2
-#define TAG_MSK		0xfffff800
+#define LOCKED		(1 << 2)
+#define PREFETCHED	(1 << 3)
 
 /*
- * bit[0: 5]: offset
- * bit[6: 10]: index
- * bit[11: 31]: tag
+ * bit[0: CACHE_LINE_SHIFT-1]: offset
+ * bit[CACHE_LINE_SHIFT: ...]: index, hashed with the bits above it unless
+ * CACHE_INDEX_PLAIN
+ * the whole line address is kept in the tag
+ *
+ * Fill @set with the set the line holding @addr maps to in each way. Only
+ * with CACHE_INDEX_SKEW do the ways differ, way i then XORs the folded
+ * upper bits times 2i+1 in.
  */
-static inline int get_index(uint32_t addr)
+static inline void get_sets(uint32_t addr, int *set)
 {
-	return (addr >> 6) & 0x1f;
+	uint32_t line = addr >> CACHE_LINE_SHIFT;
+	uint32_t h = line >> SET_BITS;
+	int w;
+
+	h ^= h >> SET_BITS;
+	for (w = 0; w < CACHE_WAYS; w++) {
+#if CACHE_INDEX == CACHE_INDEX_SKEW
+		set[w] = (line ^ h * (2 * w + 1)) & (CACHE_SETS - 1);
+#elif CACHE_INDEX == CACHE_INDEX_XOR
+		set[w] = (line ^ h) & (CACHE_SETS - 1);
+#else
+		set[w] = line & (CACHE_SETS - 1);
+#endif
+	}
 }
 
-void cache_write(uint32_t ofs, void *buf, uint32_t size)
+#if CACHE_WRITE_VALIDATE
+#define VMASK_SHIFT	(CACHE_LINE_SHIFT > 6 ? CACHE_LINE_SHIFT - 6 : 0)
+#define VMASK_FULL	(~0ull >> (64 - (CACHE_LINE_SIZE >> VMASK_SHIFT)))
+
+/* mask of granules @first to @last of a line, empty if @last < @first */
+static inline uint64_t vmask_range(int first, int last)
+{
+	if (last < first)
+		return 0;
+	return (~0ull >> (63 - last)) & (~0ull << first);
+}
+
+/*
+ * Read the bytes of way @ti of set @index that were never written from
+ * psram, making the whole line valid.
+ */
+static void cache_validate(int index, int ti)
 {
-	if (((ofs | (64 - 1)) != ((ofs + size - 1) | (64 - 1))))
-		printf("write cross boundary\n");
+	uint8_t buf[CACHE_LINE_SIZE], *p = cachelines[index][ti].data;
+	uint64_t m = vmask[index][ti];
+	int i;
 
-	int ti, i, index = get_index(ofs);
-	uint32_t *tp;
-	uint8_t *p;
+	psram_read(tags[index][ti] & LINE_MSK, buf, CACHE_LINE_SIZE);
+	stats.bytes_read += CACHE_LINE_SIZE;
+	++stats.validate_fills;
 
-	++accessed;
+	for (i = 0; i < CACHE_LINE_SIZE; i++) {
+		if (!((m >> (i >> VMASK_SHIFT)) & 1))
+			p[i] = buf[i];
+	}
+	vmask[index][ti] = VMASK_FULL;
+}
 
-	for (i = 0; i < 2; i++) {
-		tp = &tags[index][i];
-		p = cachelines[index][i].data;
-		if (*tp & VALID) {
-			if ((*tp & TAG_MSK) == (ofs & TAG_MSK)) {
-				++hit;
-				ti = i;
-				break;
-			} else {
-				if (i != 1)
-					continue;
-
-				ti = 1 - ((*tp & LRU) >> LRU_SFT);
-				tp = &tags[index][ti];
-				p = cachelines[index][ti].data;
-
-				if (*tp & DIRTY) {
-					psram_write(*tp & ~0x3f, p, 64);
-				}
-				psram_read(ofs & ~0x3f, p, 64);
-				*tp = ofs & ~0x3f;
-				*tp |= VALID;
-			}
-		} else {
-			if (i != 1)
-				continue;
+/*
+ * Make [ofs, ofs + size) of way @ti of set @index usable. Reads need all
+ * of it valid. Writes only need the granules they partially cover, and
+ * validate the ones they cover entirely.
+ */
+static inline void cache_prepare(int index, int ti, uint32_t ofs, uint32_t size, int type)
+{
+	uint32_t o = ofs & LINE_OFS, g = 1 << VMASK_SHIFT;
+	uint64_t touched = vmask_range(o >> VMASK_SHIFT, (o + size - 1) >> VMASK_SHIFT);
+	uint64_t covered = vmask_range((o + g - 1) >> VMASK_SHIFT, ((o + size) >> VMASK_SHIFT) - 1);
+
+	if (type == CACHE_WRITE)
+		touched &= ~covered;
+	if (touched & ~vmask[index][ti]) {
+		++stats.misses[type];
+		cache_validate(index, ti);
+	}
+	if (type == CACHE_WRITE)
+		vmask[index][ti] |= covered;
+}
+#else
+static inline void cache_prepare(int index, int ti, uint32_t ofs, uint32_t size, int type)
+{
+}
+#endif
+
+/* Set the reference bit of the page of @ofs, on every access. */
+static inline void cache_ref(uint32_t ofs)
+{
+#if CACHE_PAGE_REFS
+	ofs = (ofs & (CACHE_BACKING_SIZE - 1)) >> CACHE_REGION_SHIFT;
+	page_refs[ofs / 8] |= 1 << (ofs % 8);
+#endif
+}
+
+static void cache_ref_range(uint32_t ofs, uint32_t len)
+{
+	uint32_t pg;
+
+	for (pg = ofs >> CACHE_REGION_SHIFT; pg <= (ofs + len - 1) >> CACHE_REGION_SHIFT; pg++)
+		cache_ref(pg << CACHE_REGION_SHIFT);
+}
+
+#ifdef CACHE_TRACE
+static int tracing;
+
+static inline void cache_trace(int kind, uint32_t ofs, uint32_t size)
+{
+	if (tracing)
+		printf("@%c%lu %08lx\n", kind, (unsigned long)size, (unsigned long)ofs);
+}
+#else
+#define cache_trace(kind, ofs, size)	do { } while (0)
+#endif
+
+#if CACHE_STATS_3C
+/*
+ * LRU list of the last CACHE_LINES distinct lines touched, i.e. what a
+ * fully associative cache of the same size would hold. Entries are 1-based
+ * so that 0 can terminate the lists.
+ */
+#define SHADOW_LINES	CACHE_LINES
+#define SHADOW_HASH	(2 * CACHE_LINES)
+
+static uint32_t shadow_line[SHADOW_LINES + 1];
+static uint16_t shadow_prev[SHADOW_LINES + 1], shadow_next[SHADOW_LINES + 1];
+static uint16_t shadow_chain[SHADOW_LINES + 1], shadow_hash[SHADOW_HASH];
+static uint16_t shadow_head, shadow_tail, shadow_used;
+static uint32_t shadow_last = ~0u;
+
+static void shadow_unlink(int i)
+{
+	if (shadow_prev[i])
+		shadow_next[shadow_prev[i]] = shadow_next[i];
+	else
+		shadow_head = shadow_next[i];
+	if (shadow_next[i])
+		shadow_prev[shadow_next[i]] = shadow_prev[i];
+	else
+		shadow_tail = shadow_prev[i];
+}
+
+static void shadow_push(int i)
+{
+	shadow_prev[i] = 0;
+	shadow_next[i] = shadow_head;
+	if (shadow_head)
+		shadow_prev[shadow_head] = i;
+	else
+		shadow_tail = i;
+	shadow_head = i;
+}
+
+/* Touch @line in the shadow, returns 1 if it was already there. */
+static int shadow_touch(uint32_t line)
+{
+	uint16_t *pp;
+	int i, h = line & (SHADOW_HASH - 1);
+
+	if (line == shadow_last)
+		return 1;
+	shadow_last = line;
+
+	for (pp = &shadow_hash[h]; (i = *pp); pp = &shadow_chain[i]) {
+		if (shadow_line[i] == line) {
+			shadow_unlink(i);
+			shadow_push(i);
+			return 1;
+		}
+	}
+
+	if (shadow_used < SHADOW_LINES) {
+		i = ++shadow_used;
+	} else {
+		i = shadow_tail;
+		shadow_unlink(i);
+		pp = &shadow_hash[shadow_line[i] & (SHADOW_HASH - 1)];
+		while (*pp != i)
+			pp = &shadow_chain[*pp];
+		*pp = shadow_chain[i];
+	}
+
+	shadow_line[i] = line;
+	shadow_chain[i] = shadow_hash[h];
+	shadow_hash[h] = i;
+	shadow_push(i);
+	return 0;
+}
+#else
+static inline int shadow_touch(uint32_t line)
+{
+	return 0;
+}
+#endif
+
+#if CACHE_STREAM
+static struct {
+	uint32_t next;
+	uint32_t run;
+} streams[STREAM_ENTRIES];
+static int stream_rr;
+
+/*
+ * Called on every data miss, returns 1 once @line continues a run of at
+ * least STREAM_THRESHOLD consecutive missing lines.
+ */
+static int stream_detect(uint32_t line)
+{
+	int i;
+
+	for (i = 0; i < STREAM_ENTRIES; i++) {
+		if (streams[i].next == line) {
+			streams[i].next++;
+			return ++streams[i].run >= STREAM_THRESHOLD;
+		}
+	}
+
+	streams[stream_rr].next = line + 1;
+	streams[stream_rr].run = 1;
+	stream_rr = (stream_rr + 1) % STREAM_ENTRIES;
+	return 0;
+}
+#endif
+
+static int cache_pinned(uint32_t line)
+{
+	int i;
+
+	for (i = 0; i < nr_pins; i++) {
+		if (line >= pins[i].first && line <= pins[i].last)
+			return 1;
+	}
+	return 0;
+}
 
+/*
+ * Lock way @ti of the sets @set if pinned, keeping one of the ways unlocked.
+ * With CACHE_INDEX_SKEW other lines can still find all their ways locked,
+ * cache_victim() then evicts a locked line anyway.
+ */
+static void cache_lock(const int *set, int ti)
+{
+	int i, locked = 0;
+
+	if (set[ti] >= CACHE_SETS || !cache_pinned(tags[set[ti]][ti] >> CACHE_LINE_SHIFT))
+		return;
+
+	for (i = 0; i < CACHE_WAYS; i++)
+		locked += !!(tags[set[i]][i] & LOCKED);
+	if (locked < CACHE_WAYS - 1)
+		tags[set[ti]][ti] |= LOCKED;
+}
+
+static inline uint32_t cache_random(void)
+{
+	rnd ^= rnd << 13;
+	rnd ^= rnd >> 17;
+	rnd ^= rnd << 5;
+	return rnd;
+}
+
+/* Which candidate set @index is a dueling leader for, -1 for followers. */
+static int duel_leader(int index)
+{
+	int k, off = index % DUEL_GROUP;
+
+	if (index >= CACHE_SETS || CACHE_SETS < DUEL_CANDIDATES)
+		return -1;
+	for (k = 0; k < DUEL_CANDIDATES; k++) {
+		if (off == k * (DUEL_GROUP - 1) / (DUEL_CANDIDATES - 1))
+			return k;
+	}
+	return -1;
+}
+
+/* The policy set @index replaces lines with. */
+static int set_policy(int index)
+{
+	int k;
+
+	if (policy != CACHE_POLICY_DUEL)
+		return policy;
+	k = duel_leader(index);
+	return duel_candidates[k < 0 ? duel_winner : k];
+}
+
+/* Account a miss in a leader set of candidate @k, electing a new winner. */
+static void duel_miss(int k)
+{
+	int i, best = 0;
+
+	++duel_misses[k];
+	if (++duel_count < DUEL_PERIOD)
+		return;
+
+	for (i = 1; i < DUEL_CANDIDATES; i++) {
+		if (duel_misses[i] < duel_misses[best])
+			best = i;
+	}
+	if (duel_misses[best] < duel_misses[duel_winner] && best != duel_winner) {
+		duel_winner = best;
+		++stats.duel_switches;
+	}
+
+	/* age the counts so that the election follows workload phases */
+	for (i = 0; i < DUEL_CANDIDATES; i++)
+		duel_misses[i] >>= 1;
+	duel_count = 0;
+}
+
+/*
+ * RRIP victim: the first unlocked way predicted to be reused furthest
+ * away. If none is at RRPV_MAX yet, age the whole set until one is.
+ */
+static int rrip_victim(const int *set)
+{
+	int i, ti = -1;
+
+	for (i = 0; i < CACHE_WAYS; i++) {
+		if (tags[set[i]][i] & LOCKED)
+			continue;
+		if (ti < 0 || rrpv[set[i]][i] > rrpv[set[ti]][ti])
 			ti = i;
-			psram_read(ofs & ~0x3f, p, 64);
-			*tp = ofs & ~0x3f;
-			*tp |= VALID;
+	}
+	if (ti < 0)
+		return 0;
+	if (rrpv[set[ti]][ti] < RRPV_MAX) {
+		int age = RRPV_MAX - rrpv[set[ti]][ti];
+
+		for (i = 0; i < CACHE_WAYS; i++)
+			rrpv[set[i]][i] = rrpv[set[i]][i] + age > RRPV_MAX ?
+					  RRPV_MAX : rrpv[set[i]][i] + age;
+	}
+	return ti;
+}
+
+/*
+ * Pick the way to refill among way i of set @set[i], preferring an invalid
+ * one.
+ */
+static int cache_victim(const int *set, int pol)
+{
+	int i, ti = -1;
+
+	for (i = 0; i < CACHE_WAYS; i++) {
+		if (!(tags[set[i]][i] & VALID))
+			return i;
+	}
+
+	switch (pol) {
+	case CACHE_POLICY_RANDOM:
+		ti = cache_random() % CACHE_WAYS;
+		for (i = 0; i < CACHE_WAYS && (tags[set[ti]][ti] & LOCKED); i++)
+			ti = (ti + 1) % CACHE_WAYS;
+		return ti;
+	case CACHE_POLICY_SRRIP:
+	case CACHE_POLICY_BRRIP:
+		return rrip_victim(set);
+	}
+
+	for (i = 0; i < CACHE_WAYS; i++) {
+		if (tags[set[i]][i] & LOCKED)
+			continue;
+		if (ti < 0 || (int32_t)(stamp[set[i]][i] - stamp[set[ti]][ti]) < 0)
+			ti = i;
+	}
+	return ti < 0 ? 0 : ti;
+}
+
+/* Write way @ti of set @index back to psram if it is dirty. */
+static void cache_clean(int index, int ti)
+{
+	if ((tags[index][ti] & (VALID | DIRTY)) != (VALID | DIRTY))
+		return;
+#if CACHE_WRITE_VALIDATE
+	if (vmask[index][ti] != VMASK_FULL)
+		cache_validate(index, ti);
+#endif
+	psram_write(tags[index][ti] & LINE_MSK, cachelines[index][ti].data, CACHE_LINE_SIZE);
+	++stats.writebacks;
+	stats.bytes_written += CACHE_LINE_SIZE;
+	tags[index][ti] &= ~DIRTY;
+}
+
+/*
+ * Set the replacement state of the line just filled into way @ti of set
+ * @set[ti]. LIP and BIP insert at the LRU position by making the line older
+ * than the rest of the set, BRRIP inserts as "reused far away", and both
+ * take the usual path once every BIMODAL_THROTTLE fills.
+ */
+static void cache_insert(const int *set, int ti, int pol)
+{
+	int i, index = set[ti], lru_insert = 0;
+
+	rrpv[index][ti] = RRPV_MAX - 1;
+	stamp[index][ti] = ++tick;
+
+	switch (pol) {
+	case CACHE_POLICY_LIP:
+		lru_insert = 1;
+		break;
+	case CACHE_POLICY_BIP:
+		lru_insert = cache_random() % BIMODAL_THROTTLE != 0;
+		break;
+	case CACHE_POLICY_BRRIP:
+		if (cache_random() % BIMODAL_THROTTLE != 0)
+			rrpv[index][ti] = RRPV_MAX;
+		break;
+	}
+
+	if (!lru_insert || CACHE_WAYS == 1)
+		return;
+	for (i = 0; i < CACHE_WAYS; i++) {
+		if (i != ti && (tags[set[i]][i] & VALID) &&
+		    (int32_t)(stamp[set[i]][i] - stamp[index][ti]) <= 0)
+			stamp[index][ti] = stamp[set[i]][i] - 1;
+	}
+}
+
+/* Account a miss of @type, or a writeback if negative, to cache_pc. */
+static void cache_pc_account(int type)
+{
+#if CACHE_PC_PROFILE
+	uint32_t pc = cache_pc, h = (pc * 0x9e3779b1u) >> 24;
+	struct cache_pc_stat *e, *min = NULL;
+	int i;
+
+	for (i = 0; i < PC_PROBE; i++) {
+		e = &pc_table[(h + i) % PC_SLOTS];
+		if (e->pc == pc && e->count)
+			goto found;
+		if (!e->count) {
+			e->pc = pc;
+			goto found;
 		}
+		if (!min || e->count < min->count)
+			min = e;
+	}
+	e = min;
+	e->pc = pc;
+	memset(e->misses, 0, sizeof(e->misses));
+	e->writebacks = 0;
+found:
+	++e->count;
+	if (type < 0)
+		++e->writebacks;
+	else
+		++e->misses[type];
+#endif
+}
+
+/*
+ * Refill way @ti of set @set[ti] with the line holding @ofs, writing back
+ * the old contents first if they are dirty. The new contents are copied
+ * from @src if not NULL, already read from psram by the caller. Otherwise
+ * with CACHE_WRITE_VALIDATE a write miss only allocates the line,
+ * cache_prepare() then marks what the write covers valid.
+ */
+static void cache_fill(const int *set, int ti, uint32_t ofs, int type, int fa_hit, int pol,
+		       const uint8_t *src)
+{
+	int index = set[ti];
+	uint32_t *tp = &tags[index][ti];
+	uint8_t *p = cachelines[index][ti].data;
+	uint32_t line = ofs >> CACHE_LINE_SHIFT, start = cache_clock();
+	int bucket;
+
+	++stats.misses[type];
+#if CACHE_STATS_3C
+	if (type == CACHE_PREFETCH) {
+		/* not a guest access, leave the classification alone */
+	} else if (line < CACHE_BACKING_SIZE / CACHE_LINE_SIZE &&
+		   !(seen[line / 32] & (1u << (line % 32)))) {
+		seen[line / 32] |= 1u << (line % 32);
+		++stats.compulsory;
+	} else if (fa_hit) {
+		++stats.conflict;
+	} else {
+		++stats.capacity;
+	}
+#endif
+	if (type != CACHE_PREFETCH) {
+		cache_pc_account(type);
+		if ((*tp & (VALID | DIRTY)) == (VALID | DIRTY))
+			cache_pc_account(-1);
+		if (miss_hook)
+			miss_hook(ofs, type);
 	}
 
-	tags[index][1] &= ~(LRU);
-	tags[index][1] |= (ti << LRU_SFT);
-	memcpy(p + (ofs & 0x3f), buf, size);
-	*tp |= DIRTY;
+	if ((*tp & (VALID | PREFETCHED)) == (VALID | PREFETCHED))
+		++stats.prefetch_unused;
+	cache_clean(index, ti);
+	if (src) {
+		memcpy(p, src, CACHE_LINE_SIZE);
+#if CACHE_WRITE_VALIDATE
+		vmask[index][ti] = VMASK_FULL;
+	} else if (type == CACHE_WRITE) {
+		vmask[index][ti] = 0;
+		++stats.fetches_skipped;
+#endif
+	} else {
+		psram_read(ofs & LINE_MSK, p, CACHE_LINE_SIZE);
+		stats.bytes_read += CACHE_LINE_SIZE;
+#if CACHE_WRITE_VALIDATE
+		vmask[index][ti] = VMASK_FULL;
+#endif
+	}
+	*tp = ofs & LINE_MSK;
+	*tp |= VALID;
+	cache_insert(set, ti, pol);
+	if (nr_pins && cache_pinned(line)) {
+		++stats.pinned_misses;
+		cache_lock(set, ti);
+	}
+
+	bucket = 31 - __builtin_clz((cache_clock() - start) | 1);
+	if (bucket >= CACHE_LAT_BUCKETS)
+		bucket = CACHE_LAT_BUCKETS - 1;
+	++stats.miss_lat[bucket];
 }
 
-void cache_read(uint32_t ofs, void *buf, uint32_t size)
+/* Account a hit on a locked line or the first use of a prefetched one. */
+static void cache_hit_flags(int index, int ti)
+{
+	if (tags[index][ti] & LOCKED)
+		++stats.pinned_hits;
+	if (tags[index][ti] & PREFETCHED) {
+		tags[index][ti] &= ~PREFETCHED;
+		++stats.prefetch_useful;
+		if (miss_hook)
+			miss_hook(tags[index][ti] & LINE_MSK, CACHE_PREFETCH);
+	}
+}
+
+/*
+ * Find the line holding @ofs, filling it from psram on a miss, and return
+ * a pointer to its data. The tag of the line is returned in @ptp so that
+ * writers can mark it dirty.
+ *
+ * Lines of a detected data stream live in STREAM_SET only, so every miss
+ * in the cache proper checks there first. Instruction fetches never start
+ * a stream: straight-line code would otherwise never get cached.
+ */
+static uint8_t *cache_lookup(uint32_t ofs, uint32_t size, int type, uint32_t **ptp)
 {
-	if (((ofs | (64 - 1)) != ((ofs + size - 1) | (64 - 1))))
-		printf("read cross boundary\n");
+	int set[CACHE_WAYS], ti, pol, index;
+	int fa_hit = shadow_touch(ofs >> CACHE_LINE_SHIFT);
+
+	++stats.accesses[type];
+
+	get_sets(ofs, set);
+	for (ti = 0; ti < CACHE_WAYS; ti++) {
+		index = set[ti];
+		if ((tags[index][ti] & (LINE_MSK | VALID)) == ((ofs & LINE_MSK) | VALID)) {
+			if (policy != CACHE_POLICY_FIFO) {
+				stamp[index][ti] = ++tick;
+				rrpv[index][ti] = 0;
+			}
+			if (tags[index][ti] & (LOCKED | PREFETCHED))
+				cache_hit_flags(index, ti);
+			goto out;
+		}
+	}
+
+#if CACHE_STREAM
+	for (ti = 0; ti < CACHE_WAYS; ti++) {
+		if ((tags[STREAM_SET][ti] & (LINE_MSK | VALID)) == ((ofs & LINE_MSK) | VALID)) {
+			++stats.stream_hits;
+			index = STREAM_SET;
+			goto out;
+		}
+	}
+
+	if (type != CACHE_FETCH && stream_detect(ofs >> CACHE_LINE_SHIFT)) {
+		++stats.stream_fills;
+		for (ti = 0; ti < CACHE_WAYS; ti++)
+			set[ti] = STREAM_SET;
+	}
+#endif
+
+	/* skewed sets duel as the set of their first way */
+	pol = set_policy(set[0]);
+	if (policy == CACHE_POLICY_DUEL && (ti = duel_leader(set[0])) >= 0)
+		duel_miss(ti);
+	ti = cache_victim(set, pol);
+	cache_fill(set, ti, ofs, type, fa_hit, pol, NULL);
+	index = set[ti];
+
+out:
+	cache_prepare(index, ti, ofs, size, type);
+	*ptp = &tags[index][ti];
+	return cachelines[index][ti].data;
+}
+
+/*
+ * Find the line holding @ofs without filling it or touching any statistic.
+ * Returns its way and stores its set in @pindex, or returns -1 if it is not
+ * resident.
+ */
+static int cache_probe(uint32_t ofs, int *pindex)
+{
+	int set[CACHE_WAYS], ti;
+
+	get_sets(ofs, set);
+	for (ti = 0; ti < CACHE_WAYS; ti++) {
+		if ((tags[set[ti]][ti] & (LINE_MSK | VALID)) == ((ofs & LINE_MSK) | VALID)) {
+			*pindex = set[ti];
+			return ti;
+		}
+	}
+#if CACHE_STREAM
+	for (ti = 0; ti < CACHE_WAYS; ti++) {
+		if ((tags[STREAM_SET][ti] & (LINE_MSK | VALID)) == ((ofs & LINE_MSK) | VALID)) {
+			*pindex = STREAM_SET;
+			return ti;
+		}
+	}
+#endif
+	return -1;
+}
+
+/*
+ * Copy [ofs, ofs + len) of any length and alignment to @buf. Resident lines
+ * are copied from the cache, each run of missing lines is read from psram
+ * with a single call and not allocated, so bulk transfers neither pay a
+ * lookup per byte nor wipe out the cache.
+ */
+void cache_read_range(uint32_t ofs, void *buf, uint32_t len)
+{
+	uint8_t *b = buf;
+	uint32_t n, miss = 0;	/* bytes in the pending run of missing lines */
+	int index, ti;
+
+	if (len)
+		cache_ref_range(ofs, len);
+	stats.range_bytes += len;
+	for (; len; ofs += n, b += n, len -= n) {
+		n = CACHE_LINE_SIZE - (ofs & LINE_OFS);
+		if (n > len)
+			n = len;
 
-	int ti, i, index = get_index(ofs);
+		ti = cache_probe(ofs, &index);
+		if (ti < 0) {
+			miss += n;
+			continue;
+		}
+		if (miss) {
+			psram_read(ofs - miss, b - miss, miss);
+			stats.bytes_read += miss;
+			++stats.range_ios;
+			miss = 0;
+		}
+		cache_prepare(index, ti, ofs, n, CACHE_READ);
+		memcpy(b, cachelines[index][ti].data + (ofs & LINE_OFS), n);
+	}
+	if (miss) {
+		psram_read(ofs - miss, b - miss, miss);
+		stats.bytes_read += miss;
+		++stats.range_ios;
+	}
+}
+
+/*
+ * Copy @buf to [ofs, ofs + len), updating the resident lines in place and
+ * writing each run of missing lines around the cache to psram.
+ */
+void cache_write_range(uint32_t ofs, void *buf, uint32_t len)
+{
+	uint8_t *b = buf;
+	uint32_t n, miss = 0;
+	int index, ti;
+
+	if (len)
+		cache_ref_range(ofs, len);
+	stats.range_bytes += len;
+	for (; len; ofs += n, b += n, len -= n) {
+		n = CACHE_LINE_SIZE - (ofs & LINE_OFS);
+		if (n > len)
+			n = len;
+
+		ti = cache_probe(ofs, &index);
+		if (ti < 0) {
+			miss += n;
+			continue;
+		}
+		if (miss) {
+			psram_write(ofs - miss, b - miss, miss);
+			stats.bytes_written += miss;
+			++stats.range_ios;
+			miss = 0;
+		}
+		cache_prepare(index, ti, ofs, n, CACHE_WRITE);
+		memcpy(cachelines[index][ti].data + (ofs & LINE_OFS), b, n);
+		if ((cache_region(ofs) & CACHE_REGION_TYPE) != CACHE_REGION_WT) {
+			tags[index][ti] |= DIRTY;
+			continue;
+		}
+		psram_write(ofs, b, n);
+		stats.bytes_written += n;
+		++stats.range_ios;
+	}
+	if (miss) {
+		psram_write(ofs - miss, b - miss, miss);
+		stats.bytes_written += miss;
+		++stats.range_ios;
+	}
+}
+
+/*
+ * Fill the @n (at most RANGE_BATCH) missing lines from the one at @first
+ * with a single psram read, or-ing @flags into their tags.
+ */
+static void cache_install(uint32_t first, int n, int type, uint32_t flags)
+{
+	static uint8_t buf[RANGE_BATCH][CACHE_LINE_SIZE];
+	int set[CACHE_WAYS], i, ti, pol, fa_hit = 0;
+	uint32_t ofs;
+
+	psram_read(first, buf, n * CACHE_LINE_SIZE);
+	stats.bytes_read += n * CACHE_LINE_SIZE;
+
+	for (i = 0; i < n; i++) {
+		ofs = first + i * CACHE_LINE_SIZE;
+		get_sets(ofs, set);
+		pol = set_policy(set[0]);
+		ti = cache_victim(set, pol);
+		if (type != CACHE_PREFETCH)
+			fa_hit = shadow_touch(ofs >> CACHE_LINE_SHIFT);
+		cache_fill(set, ti, ofs, type, fa_hit, pol, buf[i]);
+		tags[set[ti]][ti] |= flags;
+	}
+}
+
+/*
+ * Fill the run of missing lines starting with the one holding @ofs, up to
+ * RANGE_BATCH of them and not past @end, with a single psram read.
+ */
+static void cache_batch_fill(uint32_t ofs, uint32_t end)
+{
+	uint32_t first = ofs & LINE_MSK;
+	int n, index;
+
+	for (n = 1; n < RANGE_BATCH && first + n * CACHE_LINE_SIZE < end; n++) {
+		if (cache_probe(first + n * CACHE_LINE_SIZE, &index) >= 0)
+			break;
+	}
+
+	cache_install(first, n, CACHE_READ, 0);
+	++stats.range_ios;
+}
+
+/* Whether the line at @ofs can be prefetched, i.e. is cacheable and missing. */
+static int cache_prefetchable(uint32_t ofs)
+{
+	int index;
+
+	return ofs < CACHE_BACKING_SIZE &&
+	       (cache_region(ofs) & CACHE_REGION_TYPE) != CACHE_REGION_UC &&
+	       cache_probe(ofs, &index) < 0;
+}
+
+/*
+ * Queue the line holding @ofs for cache_prefetch_drain(). Fails if the
+ * queue is full.
+ */
+int cache_prefetch(uint32_t ofs)
+{
+	if (pf_head - pf_tail == PREFETCH_QUEUE)
+		return -1;
+	pf_queue[pf_head++ % PREFETCH_QUEUE] = ofs & LINE_MSK;
+	return 0;
+}
+
+/*
+ * Fill up to @max lines from the prefetch queue, reading each run of
+ * consecutive lines with a single psram read. Queued lines that are
+ * already cached or uncached are dropped. Returns the number of lines
+ * filled.
+ */
+int cache_prefetch_drain(int max)
+{
+	uint32_t ofs;
+	int n, done = 0;
+
+	while (pf_tail != pf_head && done < max) {
+		ofs = pf_queue[pf_tail++ % PREFETCH_QUEUE];
+		++stats.accesses[CACHE_PREFETCH];
+		if (!cache_prefetchable(ofs))
+			continue;
+
+		for (n = 1; n < RANGE_BATCH && done + n < max && pf_tail != pf_head; n++) {
+			uint32_t next = pf_queue[pf_tail % PREFETCH_QUEUE];
+
+			if (next != ofs + n * CACHE_LINE_SIZE || !cache_prefetchable(next))
+				break;
+			++pf_tail;
+			++stats.accesses[CACHE_PREFETCH];
+		}
+
+		cache_install(ofs, n, CACHE_PREFETCH, PREFETCHED);
+		++stats.prefetch_ios;
+		done += n;
+	}
+	return done;
+}
+
+void cache_set_miss_hook(cache_miss_fn fn)
+{
+	miss_hook = fn;
+}
+
+/*
+ * Zero-copy access to [ofs, ofs + len): call @fn with a pointer into the
+ * cache for each piece of the range, one line at a time. For reads, runs
+ * of missing lines are filled RANGE_BATCH lines per psram read first. With
+ * CACHE_WRITE, @fn must overwrite the whole piece it is handed since
+ * missing lines are not read first, and the pieces are written back as
+ * cache_write_range() would: write-through pages to psram right away,
+ * write misses on pages that do not allocate on them around the cache.
+ * Stops at the first non-zero return of @fn and returns it, or -1 without
+ * calling it when a CACHE_WRITE covers a read-only page.
+ */
+int cache_for_each_seg(uint32_t ofs, uint32_t len, int type, cache_seg_fn fn, void *priv)
+{
+	static uint8_t bounce[CACHE_LINE_SIZE];
+	uint32_t *tp, n, end = ofs + len, pg;
+	uint8_t *p;
+	int index, ret, attr;
+
+	for (pg = ofs >> CACHE_REGION_SHIFT; type == CACHE_WRITE && len &&
+	     pg <= (end - 1) >> CACHE_REGION_SHIFT; pg++) {
+		if (cache_region(pg << CACHE_REGION_SHIFT) & CACHE_REGION_RO)
+			return -1;
+	}
+	if (len)
+		cache_ref_range(ofs, len);
+	for (; ofs != end; ofs += n) {
+		n = CACHE_LINE_SIZE - (ofs & LINE_OFS);
+		if (n > end - ofs)
+			n = end - ofs;
+		attr = cache_region(ofs) & CACHE_REGION_TYPE;
+
+		/*
+		 * uncached pages must not end up in the cache and write misses
+		 * that do not allocate go around it, bounce them
+		 */
+		if (attr == CACHE_REGION_UC ||
+		    (type == CACHE_WRITE && attr != CACHE_REGION_WB &&
+		     cache_probe(ofs, &index) < 0)) {
+			if (type != CACHE_WRITE)
+				psram_read(ofs, bounce, n);
+			stats.range_bytes += n;
+			ret = fn(priv, bounce, n);
+			if (type == CACHE_WRITE) {
+				psram_write(ofs, bounce, n);
+				stats.bytes_written += n;
+				++stats.range_ios;
+			}
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		if (type != CACHE_WRITE && cache_probe(ofs, &index) < 0)
+			cache_batch_fill(ofs, end);
+		p = cache_lookup(ofs, n, type, &tp) + (ofs & LINE_OFS);
+		if (type == CACHE_WRITE && attr != CACHE_REGION_WT)
+			*tp |= DIRTY;
+		stats.range_bytes += n;
+		ret = fn(priv, p, n);
+		if (type == CACHE_WRITE && attr == CACHE_REGION_WT) {
+			psram_write(ofs, p, n);
+			stats.bytes_written += n;
+			++stats.range_ios;
+		}
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Copy [ofs, ofs + size) to or from @buf, the range must be within a line. */
+static inline void cache_copy(uint32_t ofs, uint8_t *buf, uint32_t size, int type)
+{
+	uint32_t *tp;
+	uint8_t *p = cache_lookup(ofs, size, type, &tp) + (ofs & LINE_OFS);
+
+	if (type == CACHE_WRITE) {
+		memcpy(p, buf, size);
+		*tp |= DIRTY;
+	} else {
+		memcpy(buf, p, size);
+	}
+}
+
+/*
+ * Access within a line of a page that is not CACHE_REGION_WB. Uncached
+ * accesses go straight to psram, so do write misses of the other types.
+ * A write-through hit updates both the line and psram.
+ */
+static void __attribute__((noinline))
+cache_copy_region(uint32_t ofs, uint8_t *buf, uint32_t size, int type, int attr)
+{
 	uint32_t *tp;
 	uint8_t *p;
+	int index;
 
-	++accessed;
+	if (attr == CACHE_REGION_UC) {
+		++stats.uncached;
+		if (type == CACHE_WRITE) {
+			psram_write(ofs, buf, size);
+			stats.bytes_written += size;
+		} else {
+			psram_read(ofs, buf, size);
+			stats.bytes_read += size;
+		}
+		return;
+	}
 
-	for (i = 0; i < 2; i++) {
-		tp = &tags[index][i];
-		p = cachelines[index][i].data;
-		if (*tp & VALID) {
-			if ((*tp & TAG_MSK) == (ofs & TAG_MSK)) {
-				++hit;
-				ti = i;
-				break;
+	if (type != CACHE_WRITE) {
+		cache_copy(ofs, buf, size, type);
+		return;
+	}
+
+	if (cache_probe(ofs, &index) < 0) {
+		++stats.accesses[CACHE_WRITE];
+		++stats.misses[CACHE_WRITE];
+		++stats.write_arounds;
+		psram_write(ofs, buf, size);
+		stats.bytes_written += size;
+		return;
+	}
+
+	if (attr != CACHE_REGION_WT) {
+		cache_copy(ofs, buf, size, CACHE_WRITE);
+		return;
+	}
+
+	p = cache_lookup(ofs, size, CACHE_WRITE, &tp);
+	memcpy(p + (ofs & LINE_OFS), buf, size);
+	psram_write(ofs, buf, size);
+	stats.bytes_written += size;
+	++stats.write_throughs;
+}
+
+static inline void cache_access(uint32_t ofs, uint8_t *buf, uint32_t size, int type)
+{
+	int attr = cache_region(ofs) & CACHE_REGION_TYPE;
+
+	cache_ref(ofs);
+	if (attr == CACHE_REGION_WB)
+		cache_copy(ofs, buf, size, type);
+	else
+		cache_copy_region(ofs, buf, size, type, attr);
+}
+
+/*
+ * Slow path of an access straddling lines, misaligned guest loads and
+ * stores mostly: one lookup per line touched, each counted as an access.
+ */
+static void __attribute__((noinline))
+cache_split(uint32_t ofs, uint8_t *buf, uint32_t size, int type)
+{
+	uint32_t n;
+
+	++stats.splits;
+	for (; size; ofs += n, buf += n, size -= n) {
+		n = CACHE_LINE_SIZE - (ofs & LINE_OFS);
+		if (n > size)
+			n = size;
+		cache_access(ofs, buf, n, type);
+	}
+}
+
+static inline int cache_crosses(uint32_t ofs, uint32_t size)
+{
+	return (ofs & LINE_OFS) + size > CACHE_LINE_SIZE;
+}
+
+void cache_write(uint32_t ofs, void *buf, uint32_t size)
+{
+	cache_trace('w', ofs, size);
+
+	if (cache_crosses(ofs, size))
+		cache_split(ofs, buf, size, CACHE_WRITE);
+	else
+		cache_access(ofs, buf, size, CACHE_WRITE);
+}
+
+static inline void cache_load(uint32_t ofs, void *buf, uint32_t size, int type)
+{
+	if (cache_crosses(ofs, size))
+		cache_split(ofs, buf, size, type);
+	else
+		cache_access(ofs, buf, size, type);
+}
+
+void cache_read(uint32_t ofs, void *buf, uint32_t size)
+{
+	cache_trace('r', ofs, size);
+	cache_load(ofs, buf, size, CACHE_READ);
+}
+
+void cache_fetch(uint32_t ofs, void *buf, uint32_t size)
+{
+	cache_trace('x', ofs, size);
+	cache_load(ofs, buf, size, CACHE_FETCH);
+}
+
+/*
+ * Atomic read-modify-write of the aligned word at @ofs with a single line
+ * lookup. Returns the old value, except for CACHE_RMW_SC which returns 0
+ * when the store was done and 1 when @resv (the LR reservation, as kept in
+ * the upper bits of extraflags) does not match @ofs. A failing SC.W never
+ * touches the cache.
+ */
+uint32_t cache_rmw(uint32_t ofs, int op, uint32_t val, uint32_t resv)
+{
+	int attr = cache_region(ofs) & CACHE_REGION_TYPE, type;
+	uint32_t *tp, old;
+	uint8_t *p = NULL;
+
+	if (op == CACHE_RMW_SC && resv != (ofs & 0x1fffffff))
+		return 1;
+
+	cache_trace(op == CACHE_RMW_LR ? 'r' : 'a', ofs, 4);
+	cache_ref(ofs);
+
+	/* only write-back pages can have the line modified in place */
+	type = op == CACHE_RMW_LR ? CACHE_READ : CACHE_RMW;
+	if (attr == CACHE_REGION_WB) {
+		p = cache_lookup(ofs, 4, type, &tp) + (ofs & LINE_OFS);
+		memcpy(&old, p, 4);
+	} else {
+		cache_copy_region(ofs, (uint8_t *)&old, 4, type, attr);
+	}
+
+	switch (op) {
+	case CACHE_RMW_LR:
+		return old;
+	case CACHE_RMW_SC:
+		old = 0;
+		break;
+	case CACHE_RMW_SWAP:
+		break;
+	case CACHE_RMW_ADD:
+		val += old;
+		break;
+	case CACHE_RMW_XOR:
+		val ^= old;
+		break;
+	case CACHE_RMW_AND:
+		val &= old;
+		break;
+	case CACHE_RMW_OR:
+		val |= old;
+		break;
+	case CACHE_RMW_MIN:
+		val = ((int32_t)val < (int32_t)old) ? val : old;
+		break;
+	case CACHE_RMW_MAX:
+		val = ((int32_t)val > (int32_t)old) ? val : old;
+		break;
+	case CACHE_RMW_MINU:
+		val = (val < old) ? val : old;
+		break;
+	case CACHE_RMW_MAXU:
+		val = (val > old) ? val : old;
+		break;
+	default:
+		return old;
+	}
+
+	if (p) {
+		memcpy(p, &val, 4);
+		*tp |= DIRTY;
+	} else {
+		cache_copy_region(ofs, (uint8_t *)&val, 4, CACHE_WRITE, attr);
+	}
+	return old;
+}
+
+/*
+ * Zero the line at @ofs. On a write-back page a missing line is allocated
+ * zeroed instead of being read from psram only to be overwritten, the
+ * other types treat it as a full line write.
+ */
+static void cache_zero_line(uint32_t ofs)
+{
+	static const uint8_t zero[CACHE_LINE_SIZE];
+	int set[CACHE_WAYS], ti, pol, index;
+
+	++stats.cbo_zeroes;
+	if ((cache_region(ofs) & CACHE_REGION_TYPE) != CACHE_REGION_WB ||
+	    cache_probe(ofs, &index) >= 0) {
+		cache_access(ofs, (uint8_t *)zero, CACHE_LINE_SIZE, CACHE_WRITE);
+		return;
+	}
+
+	cache_ref(ofs);
+	++stats.accesses[CACHE_WRITE];
+	++stats.fetches_skipped;
+	get_sets(ofs, set);
+	pol = set_policy(set[0]);
+	ti = cache_victim(set, pol);
+	cache_fill(set, ti, ofs, CACHE_WRITE, shadow_touch(ofs >> CACHE_LINE_SHIFT), pol, zero);
+	tags[set[ti]][ti] |= DIRTY;
+}
+
+/*
+ * Cache block operation @op on the lines of [ofs, ofs + len): zero them,
+ * write them back if dirty, or drop them after (FLUSH) or without (INVAL)
+ * writing them back. Lines larger than the block are zeroed only where
+ * they overlap it, and flushed rather than invalidated so that the data
+ * outside it is kept.
+ */
+void cache_cbo(uint32_t ofs, uint32_t len, int op)
+{
+	static const uint8_t zero[CACHE_LINE_SIZE];
+	uint32_t start = ofs, end = ofs + len, first, last;
+	int index, ti;
+
+	cache_trace("icf?z"[op], ofs, len);
+	for (ofs &= LINE_MSK; ofs < end; ofs += CACHE_LINE_SIZE) {
+		first = ofs < start ? start : ofs;
+		last = ofs + CACHE_LINE_SIZE < end ? ofs + CACHE_LINE_SIZE : end;
+		if (op == CACHE_CBO_ZERO) {
+			if (last - first == CACHE_LINE_SIZE) {
+				cache_zero_line(ofs);
 			} else {
-				if (i != 1)
-					continue;
-
-				ti = 1 - ((*tp & LRU) >> LRU_SFT);
-				tp = &tags[index][ti];
-				p = cachelines[index][ti].data;
-
-				if (*tp & DIRTY) {
-					psram_write(*tp & ~0x3f, p, 64);
-				}
-				psram_read(ofs & ~0x3f, p, 64);
-				*tp = ofs & ~0x3f;
-				*tp |= VALID;
+				++stats.cbo_zeroes;
+				cache_access(first, (uint8_t *)zero, last - first, CACHE_WRITE);
 			}
-		} else {
-			if (i != 1)
+			continue;
+		}
+		ti = cache_probe(ofs, &index);
+		if (ti < 0)
+			continue;
+		++stats.cbo_lines;
+		if (op != CACHE_CBO_INVAL || last - first != CACHE_LINE_SIZE)
+			cache_clean(index, ti);
+		if (op == CACHE_CBO_CLEAN)
+			continue;
+		if ((tags[index][ti] & (VALID | PREFETCHED)) == (VALID | PREFETCHED))
+			++stats.prefetch_unused;
+		tags[index][ti] = 0;
+	}
+}
+
+/* Recompute the lock bits of the resident lines after the pins changed. */
+static void cache_relock(void)
+{
+	int set[CACHE_WAYS], index, ti;
+
+	for (index = 0; index < CACHE_SETS; index++) {
+		for (ti = 0; ti < CACHE_WAYS; ti++)
+			tags[index][ti] &= ~LOCKED;
+	}
+	for (index = 0; index < CACHE_SETS; index++) {
+		for (ti = 0; ti < CACHE_WAYS; ti++) {
+			if (!(tags[index][ti] & VALID))
 				continue;
+			get_sets(tags[index][ti], set);
+			cache_lock(set, ti);
+		}
+	}
+}
 
-			ti = i;
-			psram_read(ofs & ~0x3f, p, 64);
-			*tp = ofs & ~0x3f;
-			*tp |= VALID;
+/*
+ * Give the pages of [ofs, ofs + len) the memory type and flags @attr. The
+ * lines of those pages are written back and dropped, so that none of them
+ * is left cached against the new type.
+ */
+int cache_set_region(uint32_t ofs, uint32_t len, int attr)
+{
+	uint32_t first = ofs >> CACHE_REGION_SHIFT;
+	uint32_t last = (ofs + len - 1) >> CACHE_REGION_SHIFT;
+	uint32_t page;
+	int index, ti;
+
+	if (!len || last >= sizeof(cache_regions) || last < first ||
+	    (attr & ~(CACHE_REGION_TYPE | CACHE_REGION_RO)))
+		return -1;
+
+	memset(&cache_regions[first], attr, last - first + 1);
+
+	for (index = 0; index < NR_SETS; index++) {
+		for (ti = 0; ti < CACHE_WAYS; ti++) {
+			page = tags[index][ti] >> CACHE_REGION_SHIFT;
+			if (!(tags[index][ti] & VALID) || page < first || page > last)
+				continue;
+			cache_clean(index, ti);
+			tags[index][ti] = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Keep the lines of [ofs, ofs + len) in the cache once they are loaded.
+ * Fails if the range table is full or the pins would take more than a
+ * quarter of the cache. A set never has all its ways locked, so lines that
+ * collide with more pinned lines than that are cached as usual.
+ */
+int cache_pin(uint32_t ofs, uint32_t len)
+{
+	uint32_t first = ofs >> CACHE_LINE_SHIFT;
+	uint32_t last = (ofs + len - 1) >> CACHE_LINE_SHIFT;
+
+	if (!len || nr_pins == CACHE_PIN_RANGES ||
+	    pinned_lines + last - first + 1 > CACHE_PIN_MAX_LINES)
+		return -1;
+
+	pins[nr_pins].first = first;
+	pins[nr_pins].last = last;
+	nr_pins++;
+	pinned_lines += last - first + 1;
+	cache_relock();
+	return 0;
+}
+
+/* Drop a pin made by cache_pin() with the same arguments. */
+int cache_unpin(uint32_t ofs, uint32_t len)
+{
+	uint32_t first = ofs >> CACHE_LINE_SHIFT;
+	uint32_t last = (ofs + len - 1) >> CACHE_LINE_SHIFT;
+	int i;
+
+	for (i = 0; i < nr_pins; i++) {
+		if (pins[i].first == first && pins[i].last == last) {
+			pins[i] = pins[--nr_pins];
+			pinned_lines -= last - first + 1;
+			cache_relock();
+			return 0;
 		}
 	}
+	return -1;
+}
+
+int cache_set_policy(int pol)
+{
+	if (pol < 0 || pol >= CACHE_NR_POLICIES)
+		return -1;
+	policy = pol;
+	return 0;
+}
+
+int cache_get_policy(void)
+{
+	return policy;
+}
 
-	tags[index][1] &= ~(LRU);
-	tags[index][1] |= (ti << LRU_SFT);
-	memcpy(buf, p + (ofs & 0x3f), size);
+/*
+ * The policy the follower sets currently use under CACHE_POLICY_DUEL, or
+ * the fixed policy otherwise.
+ */
+int cache_policy_winner(void)
+{
+	if (policy != CACHE_POLICY_DUEL)
+		return policy;
+	return duel_candidates[duel_winner];
+}
+
+const char *cache_policy_name(int pol)
+{
+	if (pol < 0 || pol >= CACHE_NR_POLICIES)
+		return NULL;
+	return policy_names[pol];
+}
+
+/*
+ * Print every access as "@<kind><size> <offset>", kind being one of r(ead),
+ * w(rite), (e)x(ecute) or a(mo). tools/cachesim replays such captures.
+ */
+int cache_trace_enable(int on)
+{
+#ifdef CACHE_TRACE
+	tracing = on;
+	return 0;
+#else
+	return -1;
+#endif
 }
 
 void cache_get_stat(uint64_t *phit, uint64_t *paccessed)
 {
-	*phit = hit;
-	*paccessed = accessed;
+	int i;
+
+	*phit = *paccessed = 0;
+	for (i = 0; i < CACHE_PREFETCH; i++) {
+		*paccessed += stats.accesses[i];
+		*phit += stats.accesses[i] - stats.misses[i];
+	}
+}
+
+/*
+ * Copy the page reference bits, one per page of CACHE_REGION_SHIFT bytes,
+ * to @bits (CACHE_PAGES / 8 bytes) and clear them. Returns -1 when they
+ * are not built in.
+ */
+int cache_collect_refs(uint8_t *bits)
+{
+	if (!CACHE_PAGE_REFS)
+		return -1;
+	memcpy(bits, page_refs, sizeof(page_refs));
+	memset(page_refs, 0, sizeof(page_refs));
+	return 0;
+}
+
+void cache_stats_snapshot(struct cache_stats *st)
+{
+	*st = stats;
+}
+
+/*
+ * Start a new measurement phase. Lines already seen before the reset do
+ * not count as compulsory misses again (CACHE_STATS_3C).
+ */
+void cache_stats_reset(void)
+{
+	memset(&stats, 0, sizeof(stats));
+#if CACHE_PC_PROFILE
+	memset(pc_table, 0, sizeof(pc_table));
+#endif
+}
+
+/*
+ * Copy the (at most) @n guest PCs with the most events to @top, most first.
+ * Returns how many were copied, -1 when the profile is not built in.
+ */
+int cache_pc_top(struct cache_pc_stat *top, int n)
+{
+#if CACHE_PC_PROFILE
+	struct cache_pc_stat tmp;
+	int i, j, nr = 0;
+
+	if (n <= 0)
+		return 0;
+	for (i = 0; i < PC_SLOTS; i++) {
+		if (!pc_table[i].count)
+			continue;
+		/* insertion into the sorted top @n */
+		if (nr < n)
+			top[nr++] = pc_table[i];
+		else if (pc_table[i].count > top[n - 1].count)
+			top[n - 1] = pc_table[i];
+		else
+			continue;
+		for (j = nr - 1; j > 0 && top[j].count > top[j - 1].count; j--) {
+			tmp = top[j];
+			top[j] = top[j - 1];
+			top[j - 1] = tmp;
+		}
+	}
+	return nr;
+#else
+	return -1;
+#endif
 }
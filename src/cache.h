@@ -9,8 +9,165 @@
 
 #include <stdint.h>
 
+/* geometry, can be overridden at build time (see tools/cachesim) */
+#ifndef CACHE_LINE_SHIFT
+#define CACHE_LINE_SHIFT	6
+#endif
+#ifndef CACHE_SETS
+#define CACHE_SETS		32
+#endif
+#ifndef CACHE_WAYS
+#define CACHE_WAYS		2
+#endif
+#define CACHE_LINE_SIZE		(1 << CACHE_LINE_SHIFT)
+
+/* size of the backing store */
+#define CACHE_BACKING_SIZE	(8 * 1024 * 1024)
+
+/*
+ * Memory types of guest RAM, per 4 KiB page, set with cache_set_region().
+ * The type is in the low bits, CACHE_REGION_RO can be or-ed in.
+ */
+#define CACHE_REGION_SHIFT	12
+#define CACHE_REGION_WB		0x0	/* write-back, the default */
+#define CACHE_REGION_WT		0x1	/* write-through, write misses bypass the cache */
+#define CACHE_REGION_NA		0x2	/* write-back, write misses bypass the cache */
+#define CACHE_REGION_UC		0x3	/* uncached */
+#define CACHE_REGION_TYPE	0x3
+#define CACHE_REGION_RO		0x4	/* guest stores fault */
+#define CACHE_PAGES		(CACHE_BACKING_SIZE >> CACHE_REGION_SHIFT)
+
+enum cache_policy {
+	CACHE_POLICY_LRU,
+	CACHE_POLICY_FIFO,
+	CACHE_POLICY_RANDOM,
+	CACHE_POLICY_LIP,	/* LRU, but insert at the LRU position */
+	CACHE_POLICY_BIP,	/* LIP, inserting at MRU once in a while */
+	CACHE_POLICY_SRRIP,	/* static re-reference interval prediction */
+	CACHE_POLICY_BRRIP,	/* bimodal RRIP */
+	CACHE_POLICY_DUEL,	/* whichever of LRU/BIP/SRRIP/BRRIP misses least */
+	CACHE_NR_POLICIES,
+};
+
+/* cache_rmw() operations, encoded like the funct5 field of RV32A */
+#define CACHE_RMW_ADD	0x00
+#define CACHE_RMW_SWAP	0x01
+#define CACHE_RMW_LR	0x02
+#define CACHE_RMW_SC	0x03
+#define CACHE_RMW_XOR	0x04
+#define CACHE_RMW_OR	0x08
+#define CACHE_RMW_AND	0x0c
+#define CACHE_RMW_MIN	0x10
+#define CACHE_RMW_MAX	0x14
+#define CACHE_RMW_MINU	0x18
+#define CACHE_RMW_MAXU	0x1c
+
+/* cache_cbo() operations, encoded like the funct12 of the RISC-V CBO instructions */
+#define CACHE_CBO_INVAL	0
+#define CACHE_CBO_CLEAN	1
+#define CACHE_CBO_FLUSH	2
+#define CACHE_CBO_ZERO	4
+
+enum cache_access {
+	CACHE_READ,
+	CACHE_WRITE,
+	CACHE_FETCH,
+	CACHE_RMW,		/* AMOs and SC.W, filled like reads */
+	CACHE_PREFETCH,		/* lines queued with cache_prefetch() */
+	CACHE_NR_ACCESS,
+};
+
+/* miss latency bucket i counts misses serviced in [2^i, 2^(i+1)) ticks */
+#define CACHE_LAT_BUCKETS	20
+
+struct cache_stats {
+	uint64_t accesses[CACHE_NR_ACCESS];
+	uint64_t misses[CACHE_NR_ACCESS];
+	/* the 3 Cs of the misses, CACHE_STATS_3C only */
+	uint64_t compulsory;		/* first touch of the line since boot */
+	uint64_t conflict;		/* would have hit if fully associative */
+	uint64_t capacity;		/* everything else */
+	uint64_t validate_fills;	/* reads of partially written lines */
+	uint64_t fetches_skipped;	/* write misses allocated without a read */
+	uint64_t stream_fills;		/* misses that bypassed into the stream buffer */
+	uint64_t stream_hits;		/* hits in the stream buffer */
+	uint64_t prefetch_ios;		/* psram reads of the prefetch queue */
+	uint64_t prefetch_useful;	/* prefetched lines used before eviction */
+	uint64_t prefetch_unused;	/* prefetched lines evicted unused */
+	uint64_t pinned_hits;		/* hits on locked lines */
+	uint64_t pinned_misses;		/* misses on lines of pinned ranges */
+	uint64_t splits;		/* accesses straddling lines */
+	uint64_t range_bytes;		/* moved by the range calls */
+	uint64_t range_ios;		/* backing store transfers of the range calls */
+	uint64_t duel_switches;		/* winner changes of CACHE_POLICY_DUEL */
+	uint64_t cbo_zeroes;		/* lines zeroed by cache_cbo() */
+	uint64_t cbo_lines;		/* lines cleaned or dropped by cache_cbo() */
+	uint64_t uncached;		/* accesses to CACHE_REGION_UC pages */
+	uint64_t write_throughs;	/* write hits also written to psram */
+	uint64_t write_arounds;		/* write misses not allocated */
+	uint64_t writebacks;		/* dirty lines written back on eviction */
+	uint64_t bytes_read;		/* from the backing store */
+	uint64_t bytes_written;		/* to the backing store */
+	uint32_t miss_lat[CACHE_LAT_BUCKETS];
+};
+
+/* misses and writebacks caused by a guest instruction, see cache_pc_top() */
+struct cache_pc_stat {
+	uint32_t pc;				/* offset, as set in cache_pc */
+	uint32_t count;				/* events, with those taken over */
+	uint32_t misses[CACHE_PREFETCH];	/* by enum cache_access */
+	uint32_t writebacks;			/* of dirty victims */
+};
+
+/* offset of the guest instruction making the coming accesses, kept up by the caller */
+extern uint32_t cache_pc;
+
+extern uint8_t cache_regions[CACHE_BACKING_SIZE >> CACHE_REGION_SHIFT];
+
+static inline int cache_region(uint32_t ofs)
+{
+	ofs >>= CACHE_REGION_SHIFT;
+	return ofs < sizeof(cache_regions) ? cache_regions[ofs] : CACHE_REGION_WB;
+}
+
+/* whether a guest store to [ofs, ofs + size) has to fault */
+static inline int cache_store_denied(uint32_t ofs, uint32_t size)
+{
+	return (cache_region(ofs) | cache_region(ofs + size - 1)) & CACHE_REGION_RO;
+}
+
+/*
+ * Called for every demand miss with its offset and enum cache_access type,
+ * and with CACHE_PREFETCH the first time a prefetched line is used.
+ */
+typedef void (*cache_miss_fn)(uint32_t ofs, int type);
+
+/* called with pieces of a range as they sit in the cache */
+typedef int (*cache_seg_fn)(void *priv, uint8_t *data, uint32_t len);
+
 void cache_write(uint32_t ofs, void *buf, uint32_t size);
 void cache_read(uint32_t ofs, void *buf, uint32_t size);
+void cache_fetch(uint32_t ofs, void *buf, uint32_t size);
+void cache_read_range(uint32_t ofs, void *buf, uint32_t len);
+void cache_write_range(uint32_t ofs, void *buf, uint32_t len);
+int cache_for_each_seg(uint32_t ofs, uint32_t len, int type, cache_seg_fn fn, void *priv);
+int cache_prefetch(uint32_t ofs);
+int cache_prefetch_drain(int max);
+void cache_set_miss_hook(cache_miss_fn fn);
+uint32_t cache_rmw(uint32_t ofs, int op, uint32_t val, uint32_t resv);
+void cache_cbo(uint32_t ofs, uint32_t len, int op);
 void cache_get_stat(uint64_t *phit, uint64_t *paccessed);
+int cache_collect_refs(uint8_t *bits);
+int cache_pc_top(struct cache_pc_stat *top, int n);
+void cache_stats_snapshot(struct cache_stats *st);
+void cache_stats_reset(void);
+int cache_set_region(uint32_t ofs, uint32_t len, int attr);
+int cache_pin(uint32_t ofs, uint32_t len);
+int cache_unpin(uint32_t ofs, uint32_t len);
+int cache_set_policy(int pol);
+int cache_get_policy(void);
+const char *cache_policy_name(int pol);
+int cache_policy_winner(void);
+int cache_trace_enable(int on);
 
 #endif /* CACHE_H */
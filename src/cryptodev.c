@@ -0,0 +1,332 @@
+/*
+ * Crypto offload device.
+ *
+ * The guest writes the address of a struct cryptodev_desc to
+ * CRYPTODEV_DESC. The device runs it through mbedtls and writes the status
+ * back to the descriptor and to CRYPTODEV_STATUS before the store retires,
+ * so a guest polling the status never sees CRYPTODEV_BUSY. There is no
+ * interrupt line, the platform has no interrupt controller for one.
+ *
+ * On the ESP32-S3, mbedtls drives the SHA and AES engines
+ * (CONFIG_MBEDTLS_HARDWARE_SHA and _AES). Built for a host, without
+ * ESP_PLATFORM, the software implementation of a host mbedtls stands in
+ * for them, e.g.
+ *
+ *   cc -O2 -c -I../../src ../../src/cryptodev.c ../../src/cache.c
+ *
+ * next to a program that provides psram.h, as tools/cachesim does, and
+ * linked with -lmbedcrypto.
+ *
+ * Guest buffers are moved through the cache in CRYPTODEV_CHUNK pieces, so
+ * the device sees the guest's dirty lines and the guest sees its results.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_log.h"
+#include "esp_timer.h"
+#else
+#include <stdio.h>
+#include <time.h>
+#define ESP_LOGI(tag, fmt, ...)	printf("I %s: " fmt "\n", tag, ##__VA_ARGS__)
+static inline int64_t esp_timer_get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+}
+#endif
+#include "mbedtls/aes.h"
+#include "mbedtls/gcm.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/sha256.h"
+
+#include "cache.h"
+#include "cryptodev.h"
+
+#define TAG "cryptodev"
+
+#define CRYPTODEV_CHUNK		512
+/* a single update_ad call, TLS records only have 13 bytes */
+#define CRYPTODEV_AAD_MAX	256
+#define CRYPTODEV_GCM_IV	12
+#define CRYPTODEV_GCM_TAG	16
+
+static const char *const op_names[CRYPTODEV_NR_OPS] = {
+	[CRYPTODEV_SHA1]	= "sha1",
+	[CRYPTODEV_SHA256]	= "sha256",
+	[CRYPTODEV_AES_CBC_ENC]	= "cbc(aes) enc",
+	[CRYPTODEV_AES_CBC_DEC]	= "cbc(aes) dec",
+	[CRYPTODEV_AES_GCM_ENC]	= "gcm(aes) enc",
+	[CRYPTODEV_AES_GCM_DEC]	= "gcm(aes) dec",
+};
+
+static struct {
+	uint32_t ops, errors;
+	uint64_t bytes;
+	int64_t us;
+} stats[CRYPTODEV_NR_OPS];
+
+static uint32_t ram_base, ram_size;
+static uint32_t status;
+static uint8_t in[CRYPTODEV_CHUNK], out[CRYPTODEV_CHUNK];
+
+/*
+ * RAM offset of len bytes at guest address addr, -1 unless all in RAM. Any
+ * address will do for an empty buffer.
+ */
+static int guest_ofs(uint32_t addr, uint32_t len, uint32_t *ofs)
+{
+	*ofs = addr - ram_base;
+	return !len || (*ofs <= ram_size && len <= ram_size - *ofs) ? 0 : -1;
+}
+
+static int cryptodev_sha(struct cryptodev_desc *d, uint32_t src)
+{
+	mbedtls_sha1_context sha1;
+	mbedtls_sha256_context sha256;
+	uint8_t digest[32];
+	uint32_t done, n, dst, size = d->op == CRYPTODEV_SHA1 ? 20 : 32;
+	int ret;
+
+	if (guest_ofs(d->dst, size, &dst))
+		return CRYPTODEV_EFAULT;
+
+	if (d->op == CRYPTODEV_SHA1) {
+		mbedtls_sha1_init(&sha1);
+		ret = mbedtls_sha1_starts(&sha1);
+	} else {
+		mbedtls_sha256_init(&sha256);
+		ret = mbedtls_sha256_starts(&sha256, 0);
+	}
+	for (done = 0; !ret && done < d->len; done += n) {
+		n = d->len - done < sizeof(in) ? d->len - done : sizeof(in);
+		cache_read_range(src + done, in, n);
+		if (d->op == CRYPTODEV_SHA1)
+			ret = mbedtls_sha1_update(&sha1, in, n);
+		else
+			ret = mbedtls_sha256_update(&sha256, in, n);
+	}
+	if (d->op == CRYPTODEV_SHA1) {
+		if (!ret)
+			ret = mbedtls_sha1_finish(&sha1, digest);
+		mbedtls_sha1_free(&sha1);
+	} else {
+		if (!ret)
+			ret = mbedtls_sha256_finish(&sha256, digest);
+		mbedtls_sha256_free(&sha256);
+	}
+	if (ret)
+		return CRYPTODEV_EINVAL;
+	cache_write_range(dst, digest, size);
+	return CRYPTODEV_OK;
+}
+
+static int cryptodev_cbc(struct cryptodev_desc *d, uint32_t src, uint32_t dst,
+			 const uint8_t *key)
+{
+	mbedtls_aes_context aes;
+	uint8_t iv[16];
+	uint32_t done, n, iv_ofs;
+	int mode = d->op == CRYPTODEV_AES_CBC_ENC ? MBEDTLS_AES_ENCRYPT : MBEDTLS_AES_DECRYPT;
+	int ret;
+
+	if (d->len % 16)
+		return CRYPTODEV_EINVAL;
+	if (guest_ofs(d->iv, sizeof(iv), &iv_ofs))
+		return CRYPTODEV_EFAULT;
+	cache_read_range(iv_ofs, iv, sizeof(iv));
+
+	mbedtls_aes_init(&aes);
+	if (mode == MBEDTLS_AES_ENCRYPT)
+		ret = mbedtls_aes_setkey_enc(&aes, key, d->keylen * 8);
+	else
+		ret = mbedtls_aes_setkey_dec(&aes, key, d->keylen * 8);
+	for (done = 0; !ret && done < d->len; done += n) {
+		n = d->len - done < sizeof(in) ? d->len - done : sizeof(in);
+		cache_read_range(src + done, in, n);
+		ret = mbedtls_aes_crypt_cbc(&aes, mode, n, iv, in, out);
+		cache_write_range(dst + done, out, n);
+	}
+	mbedtls_aes_free(&aes);
+	if (ret)
+		return CRYPTODEV_EINVAL;
+	/* the next call carries on from here */
+	cache_write_range(iv_ofs, iv, sizeof(iv));
+	return CRYPTODEV_OK;
+}
+
+/* Wipe the len bytes at dst, plaintext that must not reach the guest. */
+static void cryptodev_wipe(uint32_t dst, uint32_t len)
+{
+	uint32_t done, n;
+
+	memset(out, 0, sizeof(out));
+	for (done = 0; done < len; done += n) {
+		n = len - done < sizeof(out) ? len - done : sizeof(out);
+		cache_write_range(dst + done, out, n);
+	}
+}
+
+/*
+ * Decryption writes the plaintext out chunk by chunk before the tag can be
+ * checked, so it is wiped again unless the tag matches, as
+ * mbedtls_gcm_auth_decrypt() does.
+ */
+static int cryptodev_gcm(struct cryptodev_desc *d, uint32_t src, uint32_t dst,
+			 const uint8_t *key)
+{
+	mbedtls_gcm_context gcm;
+	uint8_t iv[CRYPTODEV_GCM_IV], aad[CRYPTODEV_AAD_MAX];
+	uint8_t tag[CRYPTODEV_GCM_TAG], expected[CRYPTODEV_GCM_TAG], diff = 0;
+	uint32_t done, n, ofs, tag_ofs;
+	size_t olen;
+	int mode = d->op == CRYPTODEV_AES_GCM_ENC ? MBEDTLS_GCM_ENCRYPT : MBEDTLS_GCM_DECRYPT;
+	int i, ret;
+
+	if (d->aadlen > sizeof(aad))
+		return CRYPTODEV_EINVAL;
+	if (guest_ofs(d->iv, sizeof(iv), &ofs) || guest_ofs(d->tag, sizeof(tag), &tag_ofs))
+		return CRYPTODEV_EFAULT;
+	cache_read_range(ofs, iv, sizeof(iv));
+	if (guest_ofs(d->aad, d->aadlen, &ofs))
+		return CRYPTODEV_EFAULT;
+	cache_read_range(ofs, aad, d->aadlen);
+
+	mbedtls_gcm_init(&gcm);
+	ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, d->keylen * 8);
+	if (!ret)
+		ret = mbedtls_gcm_starts(&gcm, mode, iv, sizeof(iv));
+	if (!ret && d->aadlen)
+		ret = mbedtls_gcm_update_ad(&gcm, aad, d->aadlen);
+	for (done = 0; !ret && done < d->len; done += n) {
+		n = d->len - done < sizeof(in) ? d->len - done : sizeof(in);
+		cache_read_range(src + done, in, n);
+		ret = mbedtls_gcm_update(&gcm, in, n, out, sizeof(out), &olen);
+		cache_write_range(dst + done, out, n);
+	}
+	if (!ret)
+		ret = mbedtls_gcm_finish(&gcm, NULL, 0, &olen, tag, sizeof(tag));
+	mbedtls_gcm_free(&gcm);
+	if (ret) {
+		if (mode == MBEDTLS_GCM_DECRYPT)
+			cryptodev_wipe(dst, d->len);
+		return CRYPTODEV_EINVAL;
+	}
+
+	if (mode == MBEDTLS_GCM_ENCRYPT) {
+		cache_write_range(tag_ofs, tag, sizeof(tag));
+		return CRYPTODEV_OK;
+	}
+	cache_read_range(tag_ofs, expected, sizeof(expected));
+	for (i = 0; i < sizeof(tag); i++)
+		diff |= tag[i] ^ expected[i];
+	if (!diff)
+		return CRYPTODEV_OK;
+	cryptodev_wipe(dst, d->len);
+	return CRYPTODEV_EBADMSG;
+}
+
+static uint32_t cryptodev_run(uint32_t addr)
+{
+	struct cryptodev_desc d;
+	uint8_t key[32];
+	uint32_t desc, src, dst, ofs;
+	int64_t t = esp_timer_get_time();
+	int ret;
+
+	if (guest_ofs(addr, sizeof(d), &desc))
+		return CRYPTODEV_EFAULT;
+	cache_read_range(desc, &d, sizeof(d));
+
+	if (d.op == 0 || d.op >= CRYPTODEV_NR_OPS) {
+		ret = CRYPTODEV_EINVAL;
+		goto out;
+	}
+	/* for the hashes, dst is the digest and checked by cryptodev_sha() */
+	if (guest_ofs(d.src, d.len, &src) ||
+	    (d.op > CRYPTODEV_SHA256 && guest_ofs(d.dst, d.len, &dst))) {
+		ret = CRYPTODEV_EFAULT;
+		goto done;
+	}
+
+	switch (d.op) {
+	case CRYPTODEV_SHA1:
+	case CRYPTODEV_SHA256:
+		ret = cryptodev_sha(&d, src);
+		break;
+	default:
+		if (d.keylen != 16 && d.keylen != 24 && d.keylen != 32) {
+			ret = CRYPTODEV_EINVAL;
+			break;
+		}
+		if (guest_ofs(d.key, d.keylen, &ofs)) {
+			ret = CRYPTODEV_EFAULT;
+			break;
+		}
+		cache_read_range(ofs, key, d.keylen);
+		if (d.op <= CRYPTODEV_AES_CBC_DEC)
+			ret = cryptodev_cbc(&d, src, dst, key);
+		else
+			ret = cryptodev_gcm(&d, src, dst, key);
+		memset(key, 0, sizeof(key));
+		break;
+	}
+
+done:
+	stats[d.op].ops++;
+	stats[d.op].us += esp_timer_get_time() - t;
+	if (ret)
+		stats[d.op].errors++;
+	else
+		stats[d.op].bytes += d.len;
+out:
+	d.status = ret;
+	cache_write_range(desc + offsetof(struct cryptodev_desc, status), &d.status, sizeof(d.status));
+	return ret;
+}
+
+/* Called at every (re)start of the guest. */
+void cryptodev_init(uint32_t base, uint32_t size)
+{
+	ram_base = base;
+	ram_size = size;
+	status = CRYPTODEV_OK;
+}
+
+uint32_t cryptodev_load(uint32_t reg)
+{
+	switch (reg) {
+	case CRYPTODEV_ID:
+		return CRYPTODEV_MAGIC;
+	case CRYPTODEV_STATUS:
+		return status;
+	}
+	return 0;
+}
+
+void cryptodev_store(uint32_t reg, uint32_t val)
+{
+	if (reg == CRYPTODEV_DESC)
+		status = cryptodev_run(val);
+}
+
+void cryptodev_dump(void)
+{
+	int i;
+
+	for (i = 1; i < CRYPTODEV_NR_OPS; i++) {
+		if (!stats[i].ops)
+			continue;
+		ESP_LOGI(TAG, "%s: %"PRIu32" ops, %llu bytes, %"PRIu32" errors, %llu KiB/s",
+			 op_names[i], stats[i].ops, stats[i].bytes, stats[i].errors,
+			 stats[i].us ? stats[i].bytes * 1000000 / 1024 / stats[i].us : 0);
+	}
+}
@@ -0,0 +1,63 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef CRYPTODEV_H
+#define CRYPTODEV_H
+
+#include <stdint.h>
+
+/* guest physical window, see the crypto node of dtb.dts */
+#define CRYPTODEV_BASE		0x11200000
+#define CRYPTODEV_SIZE		0x1000
+
+/* registers */
+#define CRYPTODEV_ID		0x00	/* reads CRYPTODEV_MAGIC */
+#define CRYPTODEV_DESC		0x04	/* write a descriptor address to run it */
+#define CRYPTODEV_STATUS	0x08	/* status of the last descriptor */
+
+#define CRYPTODEV_MAGIC		0x50595243	/* "CRYP" */
+
+enum cryptodev_op {
+	CRYPTODEV_SHA1 = 1,
+	CRYPTODEV_SHA256,
+	CRYPTODEV_AES_CBC_ENC,
+	CRYPTODEV_AES_CBC_DEC,
+	CRYPTODEV_AES_GCM_ENC,
+	CRYPTODEV_AES_GCM_DEC,
+	CRYPTODEV_NR_OPS,
+};
+
+enum cryptodev_status {
+	CRYPTODEV_OK,
+	CRYPTODEV_BUSY,		/* poll until it changes */
+	CRYPTODEV_EINVAL,	/* unknown op, bad key or length */
+	CRYPTODEV_EFAULT,	/* a buffer is not in guest RAM */
+	CRYPTODEV_EBADMSG,	/* GCM tag mismatch */
+};
+
+/*
+ * In guest RAM, little endian. Addresses are guest physical, unused ones
+ * are ignored. dst may be src for in place AES, the two must not overlap
+ * otherwise.
+ */
+struct cryptodev_desc {
+	uint32_t op;		/* enum cryptodev_op */
+	uint32_t src;
+	uint32_t len;		/* of src, a multiple of 16 for CBC */
+	uint32_t dst;		/* the digest, or len bytes of AES output */
+	uint32_t key;
+	uint32_t keylen;	/* 16, 24 or 32 */
+	uint32_t iv;		/* 16 bytes for CBC, updated to chain calls; 12 for GCM */
+	uint32_t aad;		/* GCM additional data */
+	uint32_t aadlen;
+	uint32_t tag;		/* 16 byte GCM tag, written by ENC and checked by DEC */
+	uint32_t status;	/* enum cryptodev_status, written back */
+};
+
+void cryptodev_init(uint32_t ram_base, uint32_t ram_size);
+uint32_t cryptodev_load(uint32_t reg);
+void cryptodev_store(uint32_t reg, uint32_t val);
+void cryptodev_dump(void);
+
+#endif /* CRYPTODEV_H */
@@ -13,6 +13,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <math.h>
+#include <fenv.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -22,8 +24,13 @@
 #include "esp_timer.h"
 // #include "hal/usb_serial_jtag_ll.h"
 
+#include "bootlog.h"
 #include "cache.h"
+#include "cryptodev.h"
+#include "pie.h"
 #include "psram.h"
+#include "tlb.h"
+#include "wss.h"
 
 const char *TAG = "uc-rv32";
 static uint32_t ram_amt = 8 * 1024 * 1024;
@@ -86,16 +93,136 @@ static uint8_t MINIRV32_LOAD1(uint32_t ofs)
 	return val;
 }
 
+static uint32_t MINIRV32_FETCH4(uint32_t ofs)
+{
+	uint32_t val;
+	cache_pc = ofs;
+	cache_fetch(ofs, &val, 4);
+	return val;
+}
+#define MINIRV32_FETCH4 MINIRV32_FETCH4
+
+#define MINIRV32_LOAD16(ofs, p) cache_read(ofs, p, 16)
+#define MINIRV32_STORE16(ofs, p) cache_write(ofs, p, 16)
+#if PIE_XPSIMD
+#define MINIRV32_PSIMD_ALU(funct7, vd, vs1, vs2) pie_alu(funct7, vd, vs1, vs2)
+#endif
+
+// The CBO block size is the riscv,cbo*-block-size of dtb.dts, the cache
+// line size may differ. Prefetched lines are filled between two slices of
+// guest execution.
+#define MINIRV32_CBO_BLOCK 64
+#define MINIRV32_CBO(ofs, op) cache_cbo(ofs, MINIRV32_CBO_BLOCK, op)
+#define MINIRV32_PREFETCH(ofs, op) cache_prefetch(ofs)
+#define GUEST_PREFETCH_BURST 8
+
+// Internal SRAM for latency critical guest data, accessed directly with no
+// cache in front. The guest finds it as the "mmio-sram" node of dtb.dts.
+#define FAST_RAM_BASE	0x90000000
+#define FAST_RAM_SIZE	(64 * 1024)
+static uint8_t fast_ram[FAST_RAM_SIZE] __attribute__((aligned(4)));
+
+#define MINIRV32_SRAM_BASE FAST_RAM_BASE
+#define MINIRV32_SRAM_SIZE FAST_RAM_SIZE
+#define MINIRV32_SRAM fast_ram
+
+#define MINIRV32_AMO4(ofs, op, val, resv) cache_rmw(ofs, op, val, resv)
+#define MINIRV32_STORE_DENIED(ofs, size) cache_store_denied(ofs, size)
+
+// Guest timer accesses by kind, see MINIRV32_TIMER_STAT in emulator.h.
+static uint64_t timer_stats[4];
+#define MINIRV32_TIMER_STAT(n) timer_stats[n]++
+
+// Sv32 translations are cached in the software TLB of tlb.c, page table
+// walks read through the cache.
+#define MINIRV32_TLB_LOOKUP(va, asid, pte) tlb_lookup(va, asid, &(pte))
+#define MINIRV32_TLB_FILL(va, asid, pte, super) tlb_fill(va, asid, pte, super)
+#define MINIRV32_TLB_FLUSH(va, asid, flags) tlb_flush(va, asid, flags)
+#define MINIRV32_PTE_LOAD(ofs) tlb_pte_load(ofs)
+
 #include "emulator.h"
 
+static void DumpCacheStats(void)
+{
+	struct cache_stats st;
+	int i;
+
+	cache_stats_snapshot(&st);
+	ESP_LOGI(TAG, "cache read: %llu/%llu write: %llu/%llu fetch: %llu/%llu amo: %llu/%llu (misses/accesses)",
+		st.misses[CACHE_READ], st.accesses[CACHE_READ],
+		st.misses[CACHE_WRITE], st.accesses[CACHE_WRITE],
+		st.misses[CACHE_FETCH], st.accesses[CACHE_FETCH],
+		st.misses[CACHE_RMW], st.accesses[CACHE_RMW]);
+	if (st.compulsory || st.conflict || st.capacity)
+		ESP_LOGI(TAG, "cache misses compulsory: %llu conflict: %llu capacity: %llu",
+			st.compulsory, st.conflict, st.capacity);
+	ESP_LOGI(TAG, "cache write misses without fetch: %llu partial line fills: %llu",
+		st.fetches_skipped, st.validate_fills);
+	ESP_LOGI(TAG, "cache stream buffer fills: %llu hits: %llu",
+		st.stream_fills, st.stream_hits);
+	ESP_LOGI(TAG, "cache pinned line hits: %llu misses: %llu",
+		st.pinned_hits, st.pinned_misses);
+	ESP_LOGI(TAG, "cache accesses split across lines: %llu", st.splits);
+	ESP_LOGI(TAG, "cache range calls moved: %llu bytes in %llu backing transfers",
+		st.range_bytes, st.range_ios);
+	ESP_LOGI(TAG, "cache replacement: %s, winning: %s, switches: %llu",
+		cache_policy_name(cache_get_policy()), cache_policy_name(cache_policy_winner()),
+		st.duel_switches);
+	ESP_LOGI(TAG, "cache uncached accesses: %llu write-throughs: %llu write-arounds: %llu",
+		st.uncached, st.write_throughs, st.write_arounds);
+	ESP_LOGI(TAG, "cache prefetched lines: %llu in %llu backing reads, used: %llu evicted unused: %llu",
+		st.misses[CACHE_PREFETCH], st.prefetch_ios, st.prefetch_useful, st.prefetch_unused);
+	ESP_LOGI(TAG, "cache block ops zeroed: %llu cleaned or dropped: %llu lines",
+		st.cbo_zeroes, st.cbo_lines);
+	ESP_LOGI(TAG, "cache writebacks: %llu backing read: %llu written: %llu bytes",
+		st.writebacks, st.bytes_read, st.bytes_written);
+	for (i = 0; i < CACHE_LAT_BUCKETS; i++) {
+		if (st.miss_lat[i])
+			ESP_LOGI(TAG, "cache miss latency %7lu-%7lu cycles: %lu",
+				1ul << i, (2ul << i) - 1, (unsigned long)st.miss_lat[i]);
+	}
+}
+
+// Guest instructions causing the most cache misses, look them up in
+// System.map or with addr2line.
+#define MISS_PROFILE_TOP	16
+
+static void DumpMissProfile(void)
+{
+	struct cache_pc_stat top[MISS_PROFILE_TOP];
+	int i, n = cache_pc_top(top, MISS_PROFILE_TOP);
+
+	if (n < 0) {
+		ESP_LOGI(TAG, "cache miss profile not built in");
+		return;
+	}
+	ESP_LOGI(TAG, "cache misses by guest pc: read write fetch amo writebacks");
+	for (i = 0; i < n; i++)
+		ESP_LOGI(TAG, "%08"PRIx32": %"PRIu32" %"PRIu32" %"PRIu32" %"PRIu32" %"PRIu32"%s",
+			top[i].pc + MINIRV32_RAM_IMAGE_OFFSET, top[i].misses[CACHE_READ], top[i].misses[CACHE_WRITE],
+			top[i].misses[CACHE_FETCH], top[i].misses[CACHE_RMW], top[i].writebacks,
+			top[i].count != top[i].misses[CACHE_READ] + top[i].misses[CACHE_WRITE] +
+				top[i].misses[CACHE_FETCH] + top[i].misses[CACHE_RMW] + top[i].writebacks ? " (approx.)" : "");
+}
+
+// PAUSE and WRS hints taken, and the time slept in the latter.
+static uint64_t guest_pauses, guest_waits, guest_wait_us;
+
 static void DumpState(struct MiniRV32IMAState *core)
 {
 	unsigned int pc = core->pc;
 	unsigned int *regs = (unsigned int *)core->regs;
-	uint64_t thit, taccessed;
 
-	cache_get_stat(&thit, &taccessed);
-	ESP_LOGI(TAG, "hit: %llu accessed: %llu\n", thit, taccessed);
+	DumpCacheStats();
+	DumpMissProfile();
+	wss_dump();
+	tlb_dump();
+	cryptodev_dump();
+	ESP_LOGI(TAG, "spin-wait hints: %llu pause, %llu wrs, slept %llu ms",
+		guest_pauses, guest_waits, guest_wait_us / 1000);
+	ESP_LOGI(TAG, "timer mtime loads: %llu mtimecmp stores: %llu (MMIO), time reads: %llu stimecmp writes: %llu (CSR), %llu MMIO/s",
+		timer_stats[0], timer_stats[1], timer_stats[2], timer_stats[3],
+		(timer_stats[0] + timer_stats[1]) * 1000000 / (GetTimeMicroseconds() ?: 1));
 	ESP_LOGI(TAG, "PC: %08x ", pc);
 	ESP_LOGI(TAG, "Z:%08x ra:%08x sp:%08x gp:%08x tp:%08x t0:%08x t1:%08x t2:%08x s0:%08x s1:%08x a0:%08x a1:%08x a2:%08x a3:%08x a4:%08x a5:%08x ",
 		regs[0], regs[1], regs[2], regs[3], regs[4], regs[5], regs[6], regs[7],
@@ -107,6 +234,110 @@ static void DumpState(struct MiniRV32IMAState *core)
 
 static struct MiniRV32IMAState core;
 
+// Keep the start of the guest trap handlers pinned in the cache: mtvec's,
+// and stvec's physical target for a supervisor that handles its own traps.
+#define TRAP_VECTOR_PIN	128
+static struct TrapVectorPin {
+	uint32_t tvec;	// vector last pinned or tried, a failed pin is not
+	uint32_t satp;	// retried until the vector or its mapping changes
+	uint32_t ofs;	// RAM offset pinned, and its length (0 if none)
+	uint32_t len;
+} mtvec_pin, stvec_pin;
+
+static void PinTrapVector(struct TrapVectorPin *pin, uint32_t tvec, uint32_t satp)
+{
+	uint32_t pa = tvec, trap = 0, len = TRAP_VECTOR_PIN;
+
+	if (pin->len)
+		cache_unpin(pin->ofs, pin->len);
+	pin->tvec = tvec;
+	pin->satp = satp;
+	pin->len = 0;
+	if (satp & 0x80000000) {
+		pa = MiniRV32Sv32(&core, NULL, tvec, 1, MINIRV32_ACC_FETCH, &trap);
+		if (len > 0x1000 - (pa & 0xfff))
+			len = 0x1000 - (pa & 0xfff);
+	}
+	pa -= MINIRV32_RAM_IMAGE_OFFSET;
+	if (!trap && pa < ram_amt - len && !cache_pin(pa, len)) {
+		pin->ofs = pa;
+		pin->len = len;
+	}
+}
+
+static void PinTrapVectors(void)
+{
+	uint32_t satp = core.satp & 0x80000000 ? core.satp : 0;
+
+	if ((core.mtvec & ~3) != mtvec_pin.tvec)
+		PinTrapVector(&mtvec_pin, core.mtvec & ~3, 0);
+	if ((core.stvec & ~3) != stvec_pin.tvec || satp != stvec_pin.satp)
+		PinTrapVector(&stvec_pin, core.stvec & ~3, satp);
+}
+
+// Guest physical ranges that are not plain write-back RAM, for instance
+//	{ 0x80700000, 0x100000, CACHE_REGION_WT },	// a framebuffer
+// The guest can mark more with the 0x13b/0x13e CSR hints.
+static const struct MemRegion {
+	uint32_t start;
+	uint32_t len;
+	int attr;
+} mem_regions[] = {
+	{ 0, 0, 0 },	// end of the table
+};
+
+static void SetupMemRegions(void)
+{
+	int i;
+
+	cache_set_region(0, ram_amt, CACHE_REGION_WB);
+	for (i = 0; mem_regions[i].len; i++) {
+		if (cache_set_region(mem_regions[i].start - MINIRV32_RAM_IMAGE_OFFSET,
+				     mem_regions[i].len, mem_regions[i].attr))
+			ESP_LOGE(TAG, "bad memory region %08"PRIx32"\n", mem_regions[i].start);
+	}
+}
+
+// The guest's mtime ticks once every GUEST_TIME_DIV host microseconds.
+#define GUEST_TIME_DIV	6
+// Longest WRS.NTO sleep, the guest then checks what it waits for again.
+#define WRS_NTO_MAX_US	10000
+
+// Spin-wait hints. PAUSE hands the rest of the slice to the other tasks,
+// WRS.NTO sleeps until a guest timer fires, WRS.STO never more than a
+// yield. Sleeps are whole FreeRTOS ticks, shorter waits only yield.
+static void GuestIdle(int ret)
+{
+	uint64_t now = (uint64_t)core.timerh << 32 | core.timerl;
+	uint64_t match = (uint64_t)core.timermatchh << 32 | core.timermatchl;
+	uint64_t stimecmp = (uint64_t)core.stimecmph << 32 | core.stimecmpl;
+	uint64_t due = match ? match + 1 : UINT64_MAX;
+	uint64_t us = WRS_NTO_MAX_US;
+	TickType_t ticks;
+
+	if (ret == MINIRV32_PAUSE) {
+		guest_pauses++;
+		taskYIELD();
+		return;
+	}
+	guest_waits++;
+	// MTIP is due once time passes a non-zero mtimecmp, STIP once it
+	// reaches stimecmp.
+	if ((core.menvcfgh & 0x80000000) && stimecmp < due)
+		due = stimecmp;
+	if (due <= now)
+		us = 0;
+	else if (due - now < us / GUEST_TIME_DIV)
+		us = (due - now) * GUEST_TIME_DIV;
+	ticks = ret == MINIRV32_WRS_NTO ? us / (portTICK_PERIOD_MS * 1000) : 0;
+	if (!ticks) {
+		taskYIELD();
+		return;
+	}
+	vTaskDelay(ticks);
+	guest_wait_us += ticks * portTICK_PERIOD_MS * 1000;
+}
+
 #define dtb_start	0x3ff000
 #define dtb_end		0x3ff5c0
 #define kernel_start	0x200000
@@ -116,11 +347,16 @@ void app_main(void)
 {
 
 restart:
+	memset(&core, 0, sizeof(core));
+	tlb_flush(0, 0, 0);
 	core.pc = MINIRV32_RAM_IMAGE_OFFSET;
 	core.regs[10] = 0x00; //hart ID
 	 //dtb_pa must be valid pointer
 	core.regs[11] = (dtb_start - 0x200000) + MINIRV32_RAM_IMAGE_OFFSET;
-	core.extraflags |= 3; // Machine-mode.
+	core.extraflags |= 3 | MINIRV32_NO_RESERVATION << 3; // Machine-mode, no reservation.
+	SetupMemRegions();
+	cryptodev_init(MINIRV32_RAM_IMAGE_OFFSET, ram_amt);
+	bootlog_start(kernel_start, dtb_end - kernel_start);
 
 	// Image is loaded.
 	uint64_t lastTime = GetTimeMicroseconds();
@@ -129,11 +365,15 @@ restart:
 	while (1) {
 		int ret;
 		uint64_t *this_ccount = ((uint64_t*)&core.cyclel);
-		uint32_t elapsedUs = GetTimeMicroseconds() / 6 - lastTime;
+		uint32_t elapsedUs = GetTimeMicroseconds() / GUEST_TIME_DIV - lastTime;
 
 		lastTime += elapsedUs;
 		 // Execute upto 1024 cycles before breaking out.
 		ret = MiniRV32IMAStep(&core, NULL, 0, elapsedUs, instrs_per_flip);
+		bootlog_tick();
+		cache_prefetch_drain(GUEST_PREFETCH_BURST);
+		wss_tick();
+		PinTrapVectors();
 		uint64_t hit, access;
 		cache_get_stat(&hit, &access);
 		// ESP_LOGI(TAG, "Cache Hit: %llu, Access: %llu", hit, access);
@@ -144,6 +384,11 @@ restart:
 			MiniSleep();
 			*this_ccount += instrs_per_flip;
 			break;
+		case MINIRV32_PAUSE:
+		case MINIRV32_WRS_NTO:
+		case MINIRV32_WRS_STO:
+			GuestIdle(ret);
+			break;
 		case 3:
 			ESP_LOGI(TAG, "Invalid OP-Code!");
 			break;
@@ -156,6 +401,7 @@ restart:
 		//syscon code for power-off
 		case 0x5555:
 			ESP_LOGI(TAG, "POWEROFF@0x%lu", core.pc);
+			bootlog_finish();
 			DumpState(&core);
 			return;
 		default:
@@ -216,6 +462,8 @@ static uint32_t HandleControlStore(uint32_t addy, uint32_t val)
 		printf("%s", (char*)&val);
 		// while (usb_serial_jtag_ll_write_txfifo((uint8_t *)&val, 1) < 1) ;
 		// usb_serial_jtag_ll_txfifo_flush();
+	} else if (addy - CRYPTODEV_BASE < CRYPTODEV_SIZE) {
+		cryptodev_store(addy - CRYPTODEV_BASE, val);
 	}
 	return 0;
 }
@@ -227,12 +475,25 @@ static uint32_t HandleControlLoad(uint32_t addy)
 		return 0x60 | IsKBHit();
 	else if (addy == 0x10000000 && IsKBHit())
 		return ReadKBByte();
+	else if (addy - CRYPTODEV_BASE < CRYPTODEV_SIZE)
+		return cryptodev_load(addy - CRYPTODEV_BASE);
 	return 0;
 }
 
+// Print a piece of a guest string, stopping at its terminating NUL.
+static int PrintSegment(void *priv, uint8_t *data, uint32_t len)
+{
+	uint8_t *end = memchr(data, 0, len);
+
+	fwrite(data, 1, end ? end - data : len, stdout);
+	return end != NULL;
+}
+
 static void HandleOtherCSRWrite(uint8_t *image, uint16_t csrno, uint32_t value)
 {
-	uint32_t ptrstart, ptrend;
+	static uint32_t pinstart;
+	uint32_t ptrstart, n;
+	int done;
 
 	switch (csrno) {
 	case 0x136:
@@ -244,20 +505,73 @@ static void HandleOtherCSRWrite(uint8_t *image, uint16_t csrno, uint32_t value)
 	case 0x138:
 		//Print "string"
 		ptrstart = value - MINIRV32_RAM_IMAGE_OFFSET;
-		ptrend = ptrstart;
 		if (ptrstart >= ram_amt)
 			ESP_LOGE(TAG, "DEBUG PASSED INVALID PTR (%"PRIu32")\n", value);
-		while (ptrend < ram_amt) {
-			uint8_t c = MINIRV32_LOAD1(ptrend);
-			if (c == 0)
-				break;
-			printf("%c", c);
-			ptrend++;
+		else {
+			// A line at a time, so that no line past the NUL is filled.
+			do {
+				n = CACHE_LINE_SIZE - (ptrstart & (CACHE_LINE_SIZE - 1));
+				if (n > ram_amt - ptrstart)
+					n = ram_amt - ptrstart;
+				done = cache_for_each_seg(ptrstart, n, CACHE_READ, PrintSegment, NULL);
+				ptrstart += n;
+			} while (!done && ptrstart < ram_amt);
 		}
 		break;
 	case 0x139:
 		printf("%c", (uint8_t) value);
 		break;
+	case 0x13a:
+		// Cache statistics: 0 = start a new phase, 1 = dump them,
+		// 2/3 = start/stop printing an access trace (CACHE_TRACE builds),
+		// 4 = drop the recorded boot so that the next one is recorded again,
+		// 5 = dump the working set estimate, 6 = the top missing guest PCs,
+		// 7 = dump the TLB statistics, 8 = the boot is done, end the boot
+		// log recording or replay (BOOTLOG builds),
+		// 0x10 + n = switch to replacement policy n of enum cache_policy,
+		// anything else is ignored
+		if (value == 0) {
+			cache_stats_reset();
+			tlb_stats_reset();
+		} else if (value == 1)
+			DumpCacheStats();
+		else if (value == 4)
+			bootlog_discard();
+		else if (value == 5)
+			wss_dump();
+		else if (value == 6)
+			DumpMissProfile();
+		else if (value == 7)
+			tlb_dump();
+		else if (value == 8)
+			bootlog_finish();
+		else if (value >= 0x10) {
+			if (cache_set_policy(value - 0x10))
+				ESP_LOGE(TAG, "no cache policy %"PRIu32"\n", value - 0x10);
+		} else if ((value == 2 || value == 3) && cache_trace_enable(value == 2))
+			ESP_LOGE(TAG, "cache tracing not built in\n");
+		break;
+	case 0x13b:
+		// Pin hint: physical start, then the length to 0x13c (pin)
+		// or 0x13d (unpin), a length of 0 does nothing. Also the start
+		// for the 0x13e region hint.
+		pinstart = value - MINIRV32_RAM_IMAGE_OFFSET;
+		break;
+	case 0x13c:
+		if (!value)
+			break;
+		if (pinstart >= ram_amt || value > ram_amt - pinstart || cache_pin(pinstart, value))
+			ESP_LOGE(TAG, "cannot pin %"PRIu32" bytes at %08"PRIx32"\n", value, pinstart);
+		break;
+	case 0x13d:
+		if (value && cache_unpin(pinstart, value))
+			ESP_LOGE(TAG, "%"PRIu32" bytes at %08"PRIx32" not pinned\n", value, pinstart);
+		break;
+	case 0x13e:
+		// Region hint: page aligned length or-ed with CACHE_REGION_*
+		if (pinstart >= ram_amt || cache_set_region(pinstart, value & ~0xfff, value & 0xfff))
+			ESP_LOGE(TAG, "cannot set region %08"PRIx32" to %08"PRIx32"\n", pinstart, value);
+		break;
 	default:
 		break;
 	}
@@ -265,7 +579,10 @@ static void HandleOtherCSRWrite(uint8_t *image, uint16_t csrno, uint32_t value)
 
 static int32_t HandleOtherCSRRead(uint8_t *image, uint16_t csrno)
 {
-	if (csrno == 0x140) {
+	// Console input: the next byte, or -1 if there is none. It used to be
+	// 0x140, which is sscratch now that there is an S-mode; 0xcc0 is in the
+	// custom read-only range, so no standard CSR can take it again.
+	if (csrno == 0xcc0) {
 		if (!IsKBHit())
 			return -1;
 		return ReadKBByte();
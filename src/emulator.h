@@ -53,6 +53,16 @@
 	#define MINIRV32_OTHERCSR_READ(...);
 #endif
 
+// Stores (and AMOs) to RAM for which MINIRV32_STORE_DENIED( ofs, size ) is
+// true raise a store access fault, e.g. for read-only regions.
+#ifndef MINIRV32_STORE_DENIED
+	#define MINIRV32_STORE_DENIED( ofs, size ) 0
+#endif
+
+// Define MINIRV32_AMO4( ofs, funct5, val, reservation ) to let the memory bus
+// perform RV32A read-modify-writes in one access.  It returns the old value,
+// or for SC.W, 0 on success and 1 if the reservation does not match.
+
 #ifndef MINIRV32_CUSTOM_MEMORY_BUS
 	#define MINIRV32_STORE4( ofs, val ) *(uint32_t*)(image + ofs) = val
 	#define MINIRV32_STORE2( ofs, val ) *(uint16_t*)(image + ofs) = val
@@ -62,6 +72,83 @@
 	#define MINIRV32_LOAD1( ofs ) *(uint8_t*)(image + ofs)
 #endif
 
+// 16 byte Xpsimd loads and stores of RAM, at any alignment.
+#ifndef MINIRV32_LOAD16
+	#define MINIRV32_LOAD16( ofs, p ) memcpy( p, image + ofs, 16 )
+	#define MINIRV32_STORE16( ofs, p ) memcpy( image + ofs, p, 16 )
+#endif
+
+// Zicbom/Zicboz: define MINIRV32_CBO( ofs, op ) to have the memory bus act
+// on the MINIRV32_CBO_BLOCK bytes of RAM at ofs, op being the funct12 of the
+// instruction (0 CBO.INVAL, 1 CBO.CLEAN, 2 CBO.FLUSH, 4 CBO.ZERO).
+// Without it, CBO.ZERO clears the block and the others do nothing.
+#ifndef MINIRV32_CBO_BLOCK
+	#define MINIRV32_CBO_BLOCK 64
+#endif
+#ifndef MINIRV32_CBO
+	#define MINIRV32_CBO( ofs, op ) if( (op) == 4 ) memset( image + (ofs), 0, MINIRV32_CBO_BLOCK )
+#endif
+
+// Zicbop: MINIRV32_PREFETCH( ofs, op ) is told about prefetch hints to RAM,
+// op 0 for PREFETCH.I, 1 for .R and 3 for .W.
+#ifndef MINIRV32_PREFETCH
+	#define MINIRV32_PREFETCH( ofs, op )
+#endif
+
+// Sv32: MINIRV32_TLB_LOOKUP( va, asid, pte ) returns nonzero with pte set to
+// the cached leaf PTE for the 4 KiB page of va (for a superpage, with the PPN
+// of that page), MINIRV32_TLB_FILL( va, asid, pte, super ) caches one after
+// a walk and MINIRV32_TLB_FLUSH( va, asid, flags ) is SFENCE.VMA, flags bit 0
+// limiting it to va and bit 1 to the non-global translations of asid.
+// Without them every access walks the page table.  Walks read the PTEs from
+// RAM with MINIRV32_PTE_LOAD( ofs ).
+#ifndef MINIRV32_TLB_LOOKUP
+	#define MINIRV32_TLB_LOOKUP( va, asid, pte ) ( (void)(asid), 0 )
+	#define MINIRV32_TLB_FILL( va, asid, pte, super )
+	#define MINIRV32_TLB_FLUSH( va, asid, flags ) { (void)(va); (void)(asid); }
+#endif
+#ifndef MINIRV32_PTE_LOAD
+	#define MINIRV32_PTE_LOAD( ofs ) MINIRV32_LOAD4( ofs )
+#endif
+
+// MINIRV32_TIMER_STAT( n ) counts timer accesses: 0 mtime MMIO loads,
+// 1 mtimecmp MMIO stores, 2 time/timeh CSR reads, 3 stimecmp CSR writes
+// (csrr and the other set/clear forms that do not write are not counted).
+#ifndef MINIRV32_TIMER_STAT
+	#define MINIRV32_TIMER_STAT( n )
+#endif
+
+// No aligned word of RAM has this offset, so no SC.W can match it.
+#define MINIRV32_NO_RESERVATION	0x1fffffffu
+
+// Besides 1 for WFI, MiniRV32IMAStep() returns these when a spin-wait hint
+// ends the slice early, with the pc already past the instruction.  The host
+// may run something else (PAUSE) or idle (WRS.*) before the next step.
+// There is a single hart and every device finishes its work within the
+// access that starts it, so nothing but the hart itself can write a
+// reservation set: WRS waits for an interrupt to become pending, .STO for a
+// short while at most.  Without a reservation (none taken since the last
+// SC.W) WRS completes at once.
+
+#define MINIRV32_PAUSE		2
+#define MINIRV32_WRS_NTO	4
+#define MINIRV32_WRS_STO	5
+
+// Define MINIRV32_SRAM_BASE, MINIRV32_SRAM_SIZE and MINIRV32_SRAM (a uint8_t
+// pointer to that many bytes) to map a second, host memory backed, guest RAM
+// range that is accessed directly instead of through the memory bus.
+#ifdef MINIRV32_SRAM_BASE
+	#define MINIRV32_IN_SRAM( addy ) ( (uint32_t)( (addy) - MINIRV32_SRAM_BASE ) < MINIRV32_SRAM_SIZE - 3 )
+#else
+	#define MINIRV32_IN_SRAM( addy ) 0
+#endif
+
+// Instruction fetches go through their own hook so a custom bus can tell
+// them apart from data loads.
+#ifndef MINIRV32_FETCH4
+	#define MINIRV32_FETCH4( ofs ) MINIRV32_LOAD4( ofs )
+#endif
+
 // As a note: We quouple-ify these, because in HLSL, we will be operating with
 // uint4's.  We are going to uint4 data to/from system RAM.
 //
@@ -89,11 +176,39 @@ struct MiniRV32IMAState
 	uint32_t mtval;
 	uint32_t mcause;
 
-	// Note: only a few bits are used.  (Machine = 3, User = 0)
+	// Note: only a few bits are used.  (Machine = 3, Supervisor = 1, User = 0)
 	// Bits 0..1 = privilege.
 	// Bit 2 = WFI (Wait for interrupt)
-	// Bit 3+ = Load/Store reservation LSBs.
+	// Bit 3+ = Load/Store reservation LSBs, MINIRV32_NO_RESERVATION if none.
 	uint32_t extraflags;
+
+	// RV32F: f0..f31 as raw bits, fcsr = frm << 5 | fflags.
+	uint32_t fregs[32];
+	uint32_t fcsr;
+
+	// Xpsimd: v0..v7, lane 0 in the low bits of word 0.
+	uint32_t vregs[8][4];
+
+	// Only CBIE, CBCFE and CBZE, for user mode CBO instructions.
+	uint32_t menvcfg;
+	// Only STCE, Sstc's stimecmp drives mip.STIP when set.
+	uint32_t menvcfgh;
+
+	// Sstc: mip.STIP is set while time >= stimecmp.
+	uint32_t stimecmpl;
+	uint32_t stimecmph;
+
+	// S-mode, sstatus, sie and sip are views of the m registers.
+	uint32_t medeleg;
+	uint32_t mideleg;
+	uint32_t mcounteren;
+	uint32_t scounteren;
+	uint32_t stvec;
+	uint32_t sscratch;
+	uint32_t sepc;
+	uint32_t scause;
+	uint32_t stval;
+	uint32_t satp;
 };
 
 MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count );
@@ -104,6 +219,783 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 #define SETCSR( x, val ) { state->x = val; }
 #define REG( x ) state->regs[x]
 #define REGSET( x, val ) { state->regs[x] = val; }
+#define FREG( x ) state->fregs[x]
+
+#ifdef MINIRV32_SRAM_BASE
+// memcpy, since host loads and stores may have to be aligned.
+static inline uint32_t MiniRV32SRAMLoad( uint32_t ofs, int size )
+{
+	uint32_t v = 0;
+	memcpy( &v, MINIRV32_SRAM + ofs, size );
+	return v;
+}
+
+static inline void MiniRV32SRAMStore( uint32_t ofs, uint32_t v, int size )
+{
+	memcpy( MINIRV32_SRAM + ofs, &v, size );
+}
+
+// RV32A on SRAM.  Returns the value for rd, sets *illegal for unknown ops.
+static uint32_t MiniRV32SRAMAMO( uint32_t ofs, uint32_t irmid, uint32_t rs2, uint32_t resv, uint32_t raddy, int * illegal )
+{
+	uint32_t rval = MiniRV32SRAMLoad( ofs, 4 );
+	switch( irmid )
+	{
+		case 0b00010: return rval; //LR.W
+		case 0b00011: //SC.W
+			if( resv != ( raddy & 0x1fffffff ) ) return 1;
+			rval = 0;
+			break;
+		case 0b00001: break; //AMOSWAP.W
+		case 0b00000: rs2 += rval; break; //AMOADD.W
+		case 0b00100: rs2 ^= rval; break; //AMOXOR.W
+		case 0b01100: rs2 &= rval; break; //AMOAND.W
+		case 0b01000: rs2 |= rval; break; //AMOOR.W
+		case 0b10000: rs2 = ((int32_t)rs2<(int32_t)rval)?rs2:rval; break; //AMOMIN.W
+		case 0b10100: rs2 = ((int32_t)rs2>(int32_t)rval)?rs2:rval; break; //AMOMAX.W
+		case 0b11000: rs2 = (rs2<rval)?rs2:rval; break; //AMOMINU.W
+		case 0b11100: rs2 = (rs2>rval)?rs2:rval; break; //AMOMAXU.W
+		default: *illegal = 1; return 0;
+	}
+	MiniRV32SRAMStore( ofs, rs2, 4 );
+	return rval;
+}
+#endif
+
+// Sv32 address translation, for S and U-mode and for M-mode loads and
+// stores with mstatus.MPRV.  The A and D bits are not updated, accesses
+// needing them set page fault for the kernel to do it (Svade).
+#define MINIRV32_ACC_FETCH	0
+#define MINIRV32_ACC_LOAD	1
+#define MINIRV32_ACC_STORE	2
+#define MINIRV32_ACC_CBM	3	// CBO.CLEAN/FLUSH/INVAL, a load or a store will do
+#define MINIRV32_MSTATUS_MPRV	(1<<17)
+#define MINIRV32_MSTATUS_SUM	(1<<18)
+#define MINIRV32_MSTATUS_MXR	(1<<19)
+#define MINIRV32_MSTATUS_TVM	(1<<20)
+#define MINIRV32_MSTATUS_TW	(1<<21)
+#define MINIRV32_MSTATUS_TSR	(1<<22)
+#define MINIRV32_SSTATUS	0x800c6122 // SD, MXR, SUM, FS, SPP, SPIE, SIE
+#define MINIRV32_WITH_SD( v ) ( ( (v) & ~0x80000000 ) | ( ( (v) & MINIRV32_FS_MASK ) == MINIRV32_FS_MASK ? 0x80000000 : 0 ) )
+
+static int MiniRV32PTEAllows( struct MiniRV32IMAState * state, uint32_t pte, uint32_t priv, int acc )
+{
+	if( !( pte & 0x40 ) ) // A
+		return 0;
+	if( priv == 0 ? !( pte & 0x10 ) : ( ( pte & 0x10 ) && ( acc == MINIRV32_ACC_FETCH || !( CSR( mstatus ) & MINIRV32_MSTATUS_SUM ) ) ) )
+		return 0;
+	switch( acc )
+	{
+		case MINIRV32_ACC_FETCH: return pte & 0x8;
+		case MINIRV32_ACC_LOAD: return ( pte & 0x2 ) || ( ( pte & 0x8 ) && ( CSR( mstatus ) & MINIRV32_MSTATUS_MXR ) );
+		case MINIRV32_ACC_STORE: return ( pte & 0x84 ) == 0x84; // W and D
+		default: return MiniRV32PTEAllows( state, pte, priv, MINIRV32_ACC_LOAD ) || MiniRV32PTEAllows( state, pte, priv, MINIRV32_ACC_STORE );
+	}
+}
+
+// Walks the page table for va.  Returns the leaf PTE, with the G bits of
+// the levels above and, for a superpage, the PPN of va's page, 0 for a
+// page fault or 1 for a PTE outside RAM, an access fault.
+static uint32_t MiniRV32Walk( struct MiniRV32IMAState * state, uint8_t * image, uint32_t va, int * super )
+{
+	uint32_t ppn = CSR( satp ) & 0x3fffff, g = 0, pte;
+	int level;
+
+	for( level = 1; level >= 0; level-- )
+	{
+		uint32_t ofs = ( ppn << 12 ) + ( ( va >> ( 12 + 10 * level ) ) & 0x3ff ) * 4 - MINIRV32_RAM_IMAGE_OFFSET;
+		if( ppn >= 0x100000 || ofs >= MINI_RV32_RAM_SIZE - 3 )
+			return 1;
+		pte = MINIRV32_PTE_LOAD( ofs );
+		if( !( pte & 1 ) || ( pte & 6 ) == 4 ) // Not valid, or W without R.
+			return 0;
+		g |= pte & 0x20;
+		if( pte & 0xa ) // R or X, a leaf.
+		{
+			if( !level )
+				return pte | g;
+			if( pte & 0xffc00 ) // Misaligned superpage.
+				return 0;
+			*super = 1;
+			return pte | g | ( ( va >> 2 ) & 0xffc00 );
+		}
+		ppn = pte >> 10;
+	}
+	return 0;
+}
+
+static uint32_t MiniRV32Sv32( struct MiniRV32IMAState * state, uint8_t * image, uint32_t va, uint32_t priv, int acc, uint32_t * trap )
+{
+	uint32_t asid = ( CSR( satp ) >> 22 ) & 0x1ff, pte = 0;
+	int super = 0;
+
+	// A cached translation that does not allow the access is walked again,
+	// it may be stale.
+	if( !MINIRV32_TLB_LOOKUP( va, asid, pte ) || !MiniRV32PTEAllows( state, pte, priv, acc ) )
+	{
+		pte = MiniRV32Walk( state, image, va, &super );
+		if( pte == 1 )
+		{
+			*trap = acc == MINIRV32_ACC_FETCH ? (1+1) : acc == MINIRV32_ACC_LOAD ? (5+1) : (7+1);
+			return va;
+		}
+		if( !pte || !MiniRV32PTEAllows( state, pte, priv, acc ) )
+		{
+			*trap = acc == MINIRV32_ACC_FETCH ? (12+1) : acc == MINIRV32_ACC_LOAD ? (13+1) : (15+1);
+			return va;
+		}
+		MINIRV32_TLB_FILL( va, asid, pte, super );
+	}
+	if( pte >> 30 ) // Above 4 GiB.
+	{
+		*trap = acc == MINIRV32_ACC_FETCH ? (1+1) : acc == MINIRV32_ACC_LOAD ? (5+1) : (7+1);
+		return va;
+	}
+	return ( pte >> 10 << 12 ) | ( va & 0xfff );
+}
+
+// Returns the physical address of the size bytes at va, or va with *trap
+// set.  Data accesses crossing into another page are reported misaligned.
+static inline uint32_t MiniRV32Translate( struct MiniRV32IMAState * state, uint8_t * image, uint32_t va, uint32_t size, int acc, uint32_t * trap )
+{
+	uint32_t priv = CSR( extraflags ) & 3;
+
+	if( acc != MINIRV32_ACC_FETCH && priv == 3 && ( CSR( mstatus ) & MINIRV32_MSTATUS_MPRV ) )
+		priv = ( CSR( mstatus ) >> 11 ) & 3;
+	if( priv == 3 || !( CSR( satp ) & 0x80000000 ) )
+		return va;
+	if( ( va & 0xfff ) + size > 0x1000 )
+	{
+		*trap = acc == MINIRV32_ACC_LOAD ? (4+1) : (6+1);
+		return va;
+	}
+	return MiniRV32Sv32( state, image, va, priv, acc, trap );
+}
+
+// RV32C: expand a 16-bit instruction to the 32-bit one it stands for, so
+// that the decoder below only knows the full encodings.  Reserved and
+// unsupported (RV64, double precision) encodings expand to 0, an illegal
+// opcode.
+#define RVC_RD( c ) ( ( (c) >> 7 ) & 0x1f )
+#define RVC_RS2( c ) ( ( (c) >> 2 ) & 0x1f )
+#define RVC_RDP( c ) ( 8 + ( ( (c) >> 2 ) & 7 ) )   // rd', rs2'
+#define RVC_RS1P( c ) ( 8 + ( ( (c) >> 7 ) & 7 ) )  // rs1', rd'
+#define RVC_BIT( c, from, to ) ( ( ( (c) >> (from) ) & 1 ) << (to) )
+#define RV_I( imm, rs1, f3, rd, op ) ( ( (uint32_t)(imm) << 20 ) | ( (rs1) << 15 ) | ( (f3) << 12 ) | ( (rd) << 7 ) | (op) )
+#define RV_S( imm, rs2, rs1, f3, op ) ( ( ( (imm) >> 5 ) << 25 ) | ( (rs2) << 20 ) | ( (rs1) << 15 ) | ( (f3) << 12 ) | ( ( (imm) & 0x1f ) << 7 ) | (op) )
+#define RV_R( f7, rs2, rs1, f3, rd, op ) ( ( (f7) << 25 ) | ( (rs2) << 20 ) | ( (rs1) << 15 ) | ( (f3) << 12 ) | ( (rd) << 7 ) | (op) )
+
+static uint32_t MiniRV32ExpandC( uint32_t c )
+{
+	uint32_t imm, rd = RVC_RD( c ), rs2 = RVC_RS2( c );
+	int32_t simm = ( ( c >> 2 ) & 0x1f ) | ( ( c & 0x1000 ) ? 0xffffffe0 : 0 ); // imm[5:0] of CI
+
+	switch( ( ( c & 3 ) << 3 ) | ( c >> 13 ) )
+	{
+		case 0b00000: // C.ADDI4SPN
+			imm = ( ( c >> 7 ) & 0x30 ) | ( ( c >> 1 ) & 0x3c0 ) | RVC_BIT( c, 6, 2 ) | RVC_BIT( c, 5, 3 );
+			return imm ? RV_I( imm, 2, 0b000, RVC_RDP( c ), 0b0010011 ) : 0;
+		case 0b00010: // C.LW
+			imm = ( ( c >> 7 ) & 0x38 ) | RVC_BIT( c, 6, 2 ) | RVC_BIT( c, 5, 6 );
+			return RV_I( imm, RVC_RS1P( c ), 0b010, RVC_RDP( c ), 0b0000011 );
+		case 0b00011: // C.FLW
+			imm = ( ( c >> 7 ) & 0x38 ) | RVC_BIT( c, 6, 2 ) | RVC_BIT( c, 5, 6 );
+			return RV_I( imm, RVC_RS1P( c ), 0b010, RVC_RDP( c ), 0b0000111 );
+		case 0b00110: // C.SW
+			imm = ( ( c >> 7 ) & 0x38 ) | RVC_BIT( c, 6, 2 ) | RVC_BIT( c, 5, 6 );
+			return RV_S( imm, RVC_RDP( c ), RVC_RS1P( c ), 0b010, 0b0100011 );
+		case 0b00111: // C.FSW
+			imm = ( ( c >> 7 ) & 0x38 ) | RVC_BIT( c, 6, 2 ) | RVC_BIT( c, 5, 6 );
+			return RV_S( imm, RVC_RDP( c ), RVC_RS1P( c ), 0b010, 0b0100111 );
+
+		case 0b01000: // C.ADDI, C.NOP
+			return RV_I( simm & 0xfff, rd, 0b000, rd, 0b0010011 );
+		case 0b01001: // C.JAL
+		case 0b01101: // C.J
+			imm = RVC_BIT( c, 12, 11 ) | RVC_BIT( c, 11, 4 ) | ( ( c >> 1 ) & 0x300 ) | RVC_BIT( c, 8, 10 ) |
+				RVC_BIT( c, 7, 6 ) | RVC_BIT( c, 6, 7 ) | ( ( c >> 2 ) & 0xe ) | RVC_BIT( c, 2, 5 );
+			if( imm & 0x800 ) imm |= 0xfffff000;
+			return ( imm & 0x80000000 ) | ( ( imm & 0x7fe ) << 20 ) | ( ( imm & 0x800 ) << 9 ) | ( imm & 0xff000 ) |
+				( ( ( c >> 13 ) == 0b001 ) << 7 ) | 0b1101111;
+		case 0b01010: // C.LI
+			return RV_I( simm & 0xfff, 0, 0b000, rd, 0b0010011 );
+		case 0b01011:
+			if( rd == 2 ) // C.ADDI16SP
+			{
+				imm = RVC_BIT( c, 6, 4 ) | RVC_BIT( c, 5, 6 ) | ( ( c << 4 ) & 0x180 ) | RVC_BIT( c, 2, 5 ) | RVC_BIT( c, 12, 9 );
+				if( imm & 0x200 ) imm |= 0xfffffc00;
+				return imm ? RV_I( imm & 0xfff, 2, 0b000, 2, 0b0010011 ) : 0;
+			}
+			// C.LUI
+			return simm ? ( ( (uint32_t)simm << 12 ) | ( rd << 7 ) | 0b0110111 ) : 0;
+		case 0b01100: // MISC-ALU
+			rd = RVC_RS1P( c );
+			switch( ( c >> 10 ) & 3 )
+			{
+				case 0b00: // C.SRLI
+					return ( c & 0x1000 ) ? 0 : RV_R( 0, rs2, rd, 0b101, rd, 0b0010011 );
+				case 0b01: // C.SRAI
+					return ( c & 0x1000 ) ? 0 : RV_R( 0x20, rs2, rd, 0b101, rd, 0b0010011 );
+				case 0b10: // C.ANDI
+					return RV_I( simm & 0xfff, rd, 0b111, rd, 0b0010011 );
+				default:
+					if( c & 0x1000 ) return 0; // C.SUBW, C.ADDW are RV64 only
+					switch( ( c >> 5 ) & 3 )
+					{
+						case 0b00: return RV_R( 0x20, RVC_RDP( c ), rd, 0b000, rd, 0b0110011 ); // C.SUB
+						case 0b01: return RV_R( 0, RVC_RDP( c ), rd, 0b100, rd, 0b0110011 ); // C.XOR
+						case 0b10: return RV_R( 0, RVC_RDP( c ), rd, 0b110, rd, 0b0110011 ); // C.OR
+						default: return RV_R( 0, RVC_RDP( c ), rd, 0b111, rd, 0b0110011 ); // C.AND
+					}
+			}
+		case 0b01110: // C.BEQZ
+		case 0b01111: // C.BNEZ
+			imm = ( ( c >> 7 ) & 0x18 ) | ( ( c << 1 ) & 0xc0 ) | ( ( c >> 2 ) & 0x6 ) | RVC_BIT( c, 2, 5 ) | RVC_BIT( c, 12, 8 );
+			if( imm & 0x100 ) imm |= 0xfffffe00;
+			return ( ( imm & 0x1000 ) << 19 ) | ( ( imm & 0x7e0 ) << 20 ) | ( RVC_RS1P( c ) << 15 ) | ( ( c >> 13 ) & 1 ) << 12 |
+				( ( imm & 0x1e ) << 7 ) | ( ( imm & 0x800 ) >> 4 ) | 0b1100011;
+
+		case 0b10000: // C.SLLI
+			return ( c & 0x1000 ) ? 0 : RV_R( 0, rs2, rd, 0b001, rd, 0b0010011 );
+		case 0b10010: // C.LWSP
+			imm = RVC_BIT( c, 12, 5 ) | ( ( c >> 2 ) & 0x1c ) | ( ( c << 4 ) & 0xc0 );
+			return rd ? RV_I( imm, 2, 0b010, rd, 0b0000011 ) : 0;
+		case 0b10011: // C.FLWSP
+			imm = RVC_BIT( c, 12, 5 ) | ( ( c >> 2 ) & 0x1c ) | ( ( c << 4 ) & 0xc0 );
+			return RV_I( imm, 2, 0b010, rd, 0b0000111 );
+		case 0b10100:
+			if( !( c & 0x1000 ) )
+			{
+				if( rs2 ) return RV_R( 0, rs2, 0, 0b000, rd, 0b0110011 ); // C.MV
+				return rd ? RV_I( 0, rd, 0b000, 0, 0b1100111 ) : 0; // C.JR
+			}
+			if( rs2 ) return RV_R( 0, rs2, rd, 0b000, rd, 0b0110011 ); // C.ADD
+			if( rd ) return RV_I( 0, rd, 0b000, 1, 0b1100111 ); // C.JALR
+			return 0x00100073; // C.EBREAK
+		case 0b10110: // C.SWSP
+			imm = ( ( c >> 7 ) & 0x3c ) | ( ( c >> 1 ) & 0xc0 );
+			return RV_S( imm, rs2, 2, 0b010, 0b0100011 );
+		case 0b10111: // C.FSWSP
+			imm = ( ( c >> 7 ) & 0x3c ) | ( ( c >> 1 ) & 0xc0 );
+			return RV_S( imm, rs2, 2, 0b010, 0b0100111 );
+		default:
+			return 0;
+	}
+}
+
+#define MINIRV32_ROR( x, n ) ( ( (x) >> (n) ) | ( (x) << ( -(n) & 0x1f ) ) )
+
+// Zkne/Zknd: the AES S-box and its inverse.
+static const uint8_t MiniRV32AESSbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+static const uint8_t MiniRV32AESInvSbox[256] = {
+	0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+	0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+	0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+	0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+	0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+	0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+	0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+	0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+	0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+	0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+	0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+	0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+	0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+	0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+	0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+	0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d,
+};
+
+// GF(2^8) multiplication by x, for the MixColumns coefficients.
+static inline uint32_t MiniRV32AESXtime( uint32_t x ) { return ( ( x << 1 ) ^ ( ( x & 0x80 ) ? 0x1b : 0 ) ) & 0xff; }
+
+// AES32ESI, AES32ESMI, AES32DSI, AES32DSMI: one byte of an AES round column.
+static uint32_t MiniRV32AES32( uint32_t rs1, uint32_t rs2, uint32_t bs, uint32_t decrypt, uint32_t mix )
+{
+	uint32_t x = ( rs2 >> ( bs * 8 ) ) & 0xff, w;
+	x = decrypt ? MiniRV32AESInvSbox[x] : MiniRV32AESSbox[x];
+	if( !mix )
+		w = x;
+	else if( !decrypt ) // { 2, 1, 1, 3 }
+		w = ( ( MiniRV32AESXtime( x ) ^ x ) << 24 ) | ( x << 16 ) | ( x << 8 ) | MiniRV32AESXtime( x );
+	else // { e, 9, d, b }
+	{
+		uint32_t x2 = MiniRV32AESXtime( x ), x4 = MiniRV32AESXtime( x2 ), x8 = MiniRV32AESXtime( x4 );
+		w = ( ( x8 ^ x2 ^ x ) << 24 ) | ( ( x8 ^ x4 ^ x ) << 16 ) | ( ( x8 ^ x ) << 8 ) | ( x8 ^ x4 ^ x2 );
+	}
+	return rs1 ^ ( ( w << ( bs * 8 ) ) | ( bs ? w >> ( 32 - bs * 8 ) : 0 ) );
+}
+
+// Bit reversal within each byte (BREV8), and the bit (un)interleaving of ZIP/UNZIP.
+static uint32_t MiniRV32Brev8( uint32_t x )
+{
+	x = ( ( x >> 1 ) & 0x55555555 ) | ( ( x & 0x55555555 ) << 1 );
+	x = ( ( x >> 2 ) & 0x33333333 ) | ( ( x & 0x33333333 ) << 2 );
+	return ( ( x >> 4 ) & 0x0f0f0f0f ) | ( ( x & 0x0f0f0f0f ) << 4 );
+}
+
+static uint32_t MiniRV32Zip( uint32_t x, int unzip )
+{
+	uint32_t r = 0;
+	for( int i = 0; i < 16; i++ )
+	{
+		if( unzip )
+			r |= ( ( ( x >> ( 2 * i ) ) & 1 ) << i ) | ( ( ( x >> ( 2 * i + 1 ) ) & 1 ) << ( i + 16 ) );
+		else
+			r |= ( ( ( x >> i ) & 1 ) << ( 2 * i ) ) | ( ( ( x >> ( i + 16 ) ) & 1 ) << ( 2 * i + 1 ) );
+	}
+	return r;
+}
+
+// Zba, Zbb, Zbs, Zbkb and the scalar crypto Zknh, Zkne and Zknd: the OP and
+// OP-IMM encodings with a funct7 other than those of the base ISA and RV32M.
+// rs2 is the register value for OP, the immediate for OP-IMM.  min/max and
+// clz map to the MIN/MAX and NSAU instructions of Xtensa hosts.
+static uint32_t MiniRV32Bitmanip( uint32_t ir, uint32_t rs1, uint32_t rs2, uint32_t * trap )
+{
+	uint32_t is_reg = !!( ir & 0b100000 );
+	uint32_t rs2no = ( ir >> 20 ) & 0x1f;
+	uint32_t sh = rs2 & 0x1f;
+
+	// AES32{E,D}S{,M}I: funct7 is bs[1:0] 1 0 decrypt mix 1, bs selects a byte of rs2.
+	if( is_reg && ( ( ir >> 12 ) & 7 ) == 0b000 && ( ( ir >> 25 ) & 0b11001 ) == 0b10001 )
+		return MiniRV32AES32( rs1, rs2, ir >> 30, ( ir >> 27 ) & 1, ( ir >> 26 ) & 1 );
+
+	switch( ( is_reg << 10 ) | ( ( ir >> 25 ) << 3 ) | ( ( ir >> 12 ) & 7 ) )
+	{
+		case 0x400 | ( 0b0010000 << 3 ) | 0b010: return ( rs1 << 1 ) + rs2; // SH1ADD
+		case 0x400 | ( 0b0010000 << 3 ) | 0b100: return ( rs1 << 2 ) + rs2; // SH2ADD
+		case 0x400 | ( 0b0010000 << 3 ) | 0b110: return ( rs1 << 3 ) + rs2; // SH3ADD
+		case 0x400 | ( 0b0100000 << 3 ) | 0b111: return rs1 & ~rs2; // ANDN
+		case 0x400 | ( 0b0100000 << 3 ) | 0b110: return rs1 | ~rs2; // ORN
+		case 0x400 | ( 0b0100000 << 3 ) | 0b100: return ~( rs1 ^ rs2 ); // XNOR
+		case 0x400 | ( 0b0000101 << 3 ) | 0b100: return ( (int32_t)rs1 < (int32_t)rs2 ) ? rs1 : rs2; // MIN
+		case 0x400 | ( 0b0000101 << 3 ) | 0b101: return ( rs1 < rs2 ) ? rs1 : rs2; // MINU
+		case 0x400 | ( 0b0000101 << 3 ) | 0b110: return ( (int32_t)rs1 > (int32_t)rs2 ) ? rs1 : rs2; // MAX
+		case 0x400 | ( 0b0000101 << 3 ) | 0b111: return ( rs1 > rs2 ) ? rs1 : rs2; // MAXU
+		case 0x400 | ( 0b0110000 << 3 ) | 0b001: return MINIRV32_ROR( rs1, -sh & 0x1f ); // ROL
+		case 0x400 | ( 0b0110000 << 3 ) | 0b101: // ROR
+		case ( 0b0110000 << 3 ) | 0b101: return MINIRV32_ROR( rs1, sh ); // RORI
+		case 0x400 | ( 0b0000100 << 3 ) | 0b100: return ( rs2 << 16 ) | ( rs1 & 0xffff ); // PACK, ZEXT.H with rs2 = x0
+		case 0x400 | ( 0b0000100 << 3 ) | 0b111: return ( ( rs2 & 0xff ) << 8 ) | ( rs1 & 0xff ); // PACKH
+		case ( 0b0000100 << 3 ) | 0b001: // ZIP
+		case ( 0b0000100 << 3 ) | 0b101: // UNZIP
+			if( rs2no != 0b01111 ) break;
+			return MiniRV32Zip( rs1, ( ir >> 14 ) & 1 );
+		case ( 0b0001000 << 3 ) | 0b001:
+			switch( rs2no )
+			{
+				case 0b00000: return MINIRV32_ROR( rs1, 2 ) ^ MINIRV32_ROR( rs1, 13 ) ^ MINIRV32_ROR( rs1, 22 ); // SHA256SUM0
+				case 0b00001: return MINIRV32_ROR( rs1, 6 ) ^ MINIRV32_ROR( rs1, 11 ) ^ MINIRV32_ROR( rs1, 25 ); // SHA256SUM1
+				case 0b00010: return MINIRV32_ROR( rs1, 7 ) ^ MINIRV32_ROR( rs1, 18 ) ^ ( rs1 >> 3 ); // SHA256SIG0
+				case 0b00011: return MINIRV32_ROR( rs1, 17 ) ^ MINIRV32_ROR( rs1, 19 ) ^ ( rs1 >> 10 ); // SHA256SIG1
+			}
+			break;
+		// SHA-512 on register pairs, rs1 and rs2 are the halves of one 64-bit word.
+		case 0x400 | ( 0b0101000 << 3 ) | 0b000: return ( rs1 << 25 ) ^ ( rs1 << 30 ) ^ ( rs1 >> 28 ) ^ ( rs2 >> 7 ) ^ ( rs2 >> 2 ) ^ ( rs2 << 4 ); // SHA512SUM0R
+		case 0x400 | ( 0b0101001 << 3 ) | 0b000: return ( rs1 << 23 ) ^ ( rs1 >> 14 ) ^ ( rs1 >> 18 ) ^ ( rs2 >> 9 ) ^ ( rs2 << 18 ) ^ ( rs2 << 14 ); // SHA512SUM1R
+		case 0x400 | ( 0b0101010 << 3 ) | 0b000: return ( rs1 >> 1 ) ^ ( rs1 >> 7 ) ^ ( rs1 >> 8 ) ^ ( rs2 << 31 ) ^ ( rs2 << 25 ) ^ ( rs2 << 24 ); // SHA512SIG0L
+		case 0x400 | ( 0b0101110 << 3 ) | 0b000: return ( rs1 >> 1 ) ^ ( rs1 >> 7 ) ^ ( rs1 >> 8 ) ^ ( rs2 << 31 ) ^ ( rs2 << 24 ); // SHA512SIG0H
+		case 0x400 | ( 0b0101011 << 3 ) | 0b000: return ( rs1 << 3 ) ^ ( rs1 >> 6 ) ^ ( rs1 >> 19 ) ^ ( rs2 >> 29 ) ^ ( rs2 << 26 ) ^ ( rs2 << 13 ); // SHA512SIG1L
+		case 0x400 | ( 0b0101111 << 3 ) | 0b000: return ( rs1 << 3 ) ^ ( rs1 >> 6 ) ^ ( rs1 >> 19 ) ^ ( rs2 >> 29 ) ^ ( rs2 << 13 ); // SHA512SIG1H
+		case 0x400 | ( 0b0010100 << 3 ) | 0b001: // BSET
+		case ( 0b0010100 << 3 ) | 0b001: return rs1 | ( 1u << sh ); // BSETI
+		case 0x400 | ( 0b0100100 << 3 ) | 0b001: // BCLR
+		case ( 0b0100100 << 3 ) | 0b001: return rs1 & ~( 1u << sh ); // BCLRI
+		case 0x400 | ( 0b0110100 << 3 ) | 0b001: // BINV
+		case ( 0b0110100 << 3 ) | 0b001: return rs1 ^ ( 1u << sh ); // BINVI
+		case 0x400 | ( 0b0100100 << 3 ) | 0b101: // BEXT
+		case ( 0b0100100 << 3 ) | 0b101: return ( rs1 >> sh ) & 1; // BEXTI
+		case ( 0b0110000 << 3 ) | 0b001:
+			switch( rs2no )
+			{
+				case 0b00000: return rs1 ? __builtin_clz( rs1 ) : 32; // CLZ
+				case 0b00001: return rs1 ? __builtin_ctz( rs1 ) : 32; // CTZ
+				case 0b00010: return __builtin_popcount( rs1 ); // CPOP
+				case 0b00100: return (int8_t)rs1; // SEXT.B
+				case 0b00101: return (int16_t)rs1; // SEXT.H
+			}
+			break;
+		case ( 0b0010100 << 3 ) | 0b101: // ORC.B
+			if( rs2no != 0b00111 ) break;
+			return ( ( rs1 & 0xff ) ? 0xff : 0 ) | ( ( rs1 & 0xff00 ) ? 0xff00 : 0 ) |
+				( ( rs1 & 0xff0000 ) ? 0xff0000 : 0 ) | ( ( rs1 & 0xff000000 ) ? 0xff000000 : 0 );
+		case ( 0b0110100 << 3 ) | 0b101:
+			if( rs2no == 0b11000 ) return __builtin_bswap32( rs1 ); // REV8
+			if( rs2no == 0b00111 ) return MiniRV32Brev8( rs1 ); // BREV8
+			break;
+	}
+	*trap = (2+1);
+	return 0;
+}
+
+// RV32F.  The f registers hold the bits of single-precision values; with
+// FLEN = 32 there is no NaN-boxing, and a value moved in by FLW or FMV.W.X
+// reads back unchanged.  Arithmetic runs on the host FPU, with its rounding
+// mode switched only around instructions that don't round to nearest even.
+// RMM rounds to nearest even too, except in FCVT.W[U].S.  The exception
+// flags accrue in the host FPU while the core runs and are folded into
+// fflags on every exit from MiniRV32IMAStep() and on reads of fflags/fcsr.
+//
+// mstatus.FS tracks the state: F instructions and fcsr accesses are illegal
+// while it is Off, and any F instruction but FMV.X.W and FCLASS makes it
+// Dirty, so a kernel only saves the f registers of tasks that used them.
+#define MINIRV32_FS_MASK 0x6000
+#define MINIRV32_FS_DIRTY 0x80006000 // FS = Dirty and SD
+#define MINIRV32_F_CANONICAL_NAN 0x7fc00000
+#define MINIRV32_F_ISNAN( u ) ( ( (u) & 0x7fffffff ) > 0x7f800000 )
+#define MINIRV32_F_ISSNAN( u ) ( MINIRV32_F_ISNAN( u ) && !( (u) & 0x00400000 ) )
+#define MINIRV32_FFLAG_NV 0x10
+
+static inline float MiniRV32F( uint32_t u ) { float f; memcpy( &f, &u, 4 ); return f; }
+static inline uint32_t MiniRV32FBits( float f ) { uint32_t u; memcpy( &u, &f, 4 ); return u; }
+
+static void MiniRV32FFlagsSync( struct MiniRV32IMAState * state )
+{
+	int ex = fetestexcept( FE_ALL_EXCEPT );
+	if( !ex ) return;
+	feclearexcept( FE_ALL_EXCEPT );
+	CSR( fcsr ) |= ( ( ex & FE_INEXACT ) ? 0x01 : 0 ) | ( ( ex & FE_UNDERFLOW ) ? 0x02 : 0 ) |
+		( ( ex & FE_OVERFLOW ) ? 0x04 : 0 ) | ( ( ex & FE_DIVBYZERO ) ? 0x08 : 0 ) | ( ( ex & FE_INVALID ) ? 0x10 : 0 );
+}
+
+// Only a write that changes fcsr makes FS Dirty, not the read-back of csrr.
+static inline void MiniRV32FCSRWrite( struct MiniRV32IMAState * state, uint32_t v )
+{
+	if( ( v & 0xff ) != CSR( fcsr ) ) CSR( mstatus ) |= MINIRV32_FS_DIRTY;
+	SETCSR( fcsr, v & 0xff );
+}
+
+// FCVT.W.S and FCVT.WU.S, saturating with NV for NaN and out of range values.
+static uint32_t MiniRV32FCvtW( struct MiniRV32IMAState * state, float x, uint32_t rm, int is_unsigned )
+{
+	float r;
+
+	// The flags are set explicitly below, whatever the libm rounding raises.
+	MiniRV32FFlagsSync( state );
+	switch( rm )
+	{
+		case 0b000: r = nearbyintf( x ); break; // RNE, the host mode
+		case 0b001: r = truncf( x ); break; // RTZ
+		case 0b010: r = floorf( x ); break; // RDN
+		case 0b011: r = ceilf( x ); break; // RUP
+		default: r = roundf( x ); break; // RMM
+	}
+	feclearexcept( FE_ALL_EXCEPT );
+	if( MINIRV32_F_ISNAN( MiniRV32FBits( x ) ) || ( is_unsigned ? ( r <= -1.0f || r >= 4294967296.0f ) : ( r < -2147483648.0f || r >= 2147483648.0f ) ) )
+	{
+		CSR( fcsr ) |= MINIRV32_FFLAG_NV;
+		if( !MINIRV32_F_ISNAN( MiniRV32FBits( x ) ) && r < 0 ) return is_unsigned ? 0 : 0x80000000;
+		return is_unsigned ? 0xffffffff : 0x7fffffff;
+	}
+	if( r != x ) CSR( fcsr ) |= 0x01; // NX
+	return is_unsigned ? (uint32_t)r : (uint32_t)(int32_t)r;
+}
+
+// OP-FP and the fused multiply-adds.  Returns the result, with *frd set if it
+// goes to an f register rather than an x register.
+static uint32_t MiniRV32FP( struct MiniRV32IMAState * state, uint32_t ir, int * frd, uint32_t * trap )
+{
+	static const int host_rm[5] = { FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD, FE_TONEAREST };
+	uint32_t rs1no = ( ir >> 15 ) & 0x1f, rs2no = ( ir >> 20 ) & 0x1f, f3 = ( ir >> 12 ) & 7, rm = f3;
+	uint32_t a = FREG( rs1no ), b = FREG( rs2no );
+	// FMADD.S, FMSUB.S, FNMSUB.S and FNMADD.S become 0x20 to 0x23
+	uint32_t funct5 = ( ( ir & 0x7f ) == 0b1010011 ) ? ( ir >> 27 ) : ( 0x20 | ( ( ir >> 2 ) & 3 ) );
+	float x = MiniRV32F( a ), y = MiniRV32F( b ), z = 0;
+
+	if( !( CSR( mstatus ) & MINIRV32_FS_MASK ) || ( ir & 0x06000000 ) ) // FS is Off, or fmt isn't S
+	{
+		*trap = (2+1);
+		return 0;
+	}
+	if( funct5 != 0b11100 )
+		CSR( mstatus ) |= MINIRV32_FS_DIRTY;
+
+	// FADD, FSUB, FMUL, FDIV, FSQRT, FCVT.W[U].S, FCVT.S.W[U] and the FMAs round.
+	if( funct5 >= 0x20 || ( ( 0x0500080f >> funct5 ) & 1 ) )
+	{
+		if( rm == 0b111 ) rm = CSR( fcsr ) >> 5;
+		if( rm > 0b100 || ( funct5 == 0b01011 && rs2no ) || ( ( funct5 == 0b11000 || funct5 == 0b11010 ) && rs2no > 1 ) )
+		{
+			*trap = (2+1);
+			return 0;
+		}
+		if( funct5 == 0b11000 ) // FCVT.W.S, FCVT.WU.S
+			return MiniRV32FCvtW( state, x, rm, rs2no );
+
+		if( rm != 0b000 && rm != 0b100 ) fesetround( host_rm[rm] );
+		switch( funct5 )
+		{
+			case 0b00000: z = x + y; break; // FADD.S
+			case 0b00001: z = x - y; break; // FSUB.S
+			case 0b00010: z = x * y; break; // FMUL.S
+			case 0b00011: z = x / y; break; // FDIV.S
+			case 0b01011: z = sqrtf( x ); break; // FSQRT.S
+			case 0b11010: z = rs2no ? (float)REG( rs1no ) : (float)(int32_t)REG( rs1no ); break; // FCVT.S.W, FCVT.S.WU
+			case 0x20: z = fmaf( x, y, MiniRV32F( FREG( ir >> 27 ) ) ); break; // FMADD.S
+			case 0x21: z = fmaf( x, y, -MiniRV32F( FREG( ir >> 27 ) ) ); break; // FMSUB.S
+			case 0x22: z = fmaf( -x, y, MiniRV32F( FREG( ir >> 27 ) ) ); break; // FNMSUB.S
+			case 0x23: z = fmaf( -x, y, -MiniRV32F( FREG( ir >> 27 ) ) ); break; // FNMADD.S
+		}
+		if( rm != 0b000 && rm != 0b100 ) fesetround( FE_TONEAREST );
+		*frd = 1;
+		a = MiniRV32FBits( z );
+		return MINIRV32_F_ISNAN( a ) ? MINIRV32_F_CANONICAL_NAN : a;
+	}
+
+	switch( ( funct5 << 3 ) | f3 )
+	{
+		case ( 0b00100 << 3 ) | 0b000: *frd = 1; return ( a & 0x7fffffff ) | ( b & 0x80000000 ); // FSGNJ.S
+		case ( 0b00100 << 3 ) | 0b001: *frd = 1; return ( a & 0x7fffffff ) | ( ~b & 0x80000000 ); // FSGNJN.S
+		case ( 0b00100 << 3 ) | 0b010: *frd = 1; return a ^ ( b & 0x80000000 ); // FSGNJX.S
+		case ( 0b00101 << 3 ) | 0b000: // FMIN.S
+		case ( 0b00101 << 3 ) | 0b001: // FMAX.S
+			*frd = 1;
+			if( MINIRV32_F_ISSNAN( a ) || MINIRV32_F_ISSNAN( b ) ) CSR( fcsr ) |= MINIRV32_FFLAG_NV;
+			if( MINIRV32_F_ISNAN( a ) ) return MINIRV32_F_ISNAN( b ) ? MINIRV32_F_CANONICAL_NAN : b;
+			if( MINIRV32_F_ISNAN( b ) ) return a;
+			if( x == y ) return f3 ? ( a & b ) : ( a | b ); // -0.0 is below +0.0
+			return ( ( x < y ) ^ f3 ) ? a : b;
+		case ( 0b10100 << 3 ) | 0b000: // FLE.S
+		case ( 0b10100 << 3 ) | 0b001: // FLT.S
+		case ( 0b10100 << 3 ) | 0b010: // FEQ.S
+			if( MINIRV32_F_ISNAN( a ) || MINIRV32_F_ISNAN( b ) )
+			{
+				// FEQ.S is a quiet comparison, FLT.S and FLE.S signal on any NaN
+				if( f3 != 0b010 || MINIRV32_F_ISSNAN( a ) || MINIRV32_F_ISSNAN( b ) ) CSR( fcsr ) |= MINIRV32_FFLAG_NV;
+				return 0;
+			}
+			return ( f3 == 0b010 ) ? ( x == y ) : ( f3 == 0b001 ) ? ( x < y ) : ( x <= y );
+		case ( 0b11100 << 3 ) | 0b000: // FMV.X.W
+			if( rs2no ) break;
+			return a;
+		case ( 0b11100 << 3 ) | 0b001: // FCLASS.S
+		{
+			uint32_t exp = ( a >> 23 ) & 0xff, neg = a >> 31;
+			if( rs2no ) break;
+			if( exp == 0xff )
+				return ( a & 0x7fffff ) ? ( ( a & 0x400000 ) ? 1 << 9 : 1 << 8 ) : ( neg ? 1 << 0 : 1 << 7 );
+			if( exp == 0 )
+				return ( a & 0x7fffff ) ? ( neg ? 1 << 2 : 1 << 5 ) : ( neg ? 1 << 3 : 1 << 4 );
+			return neg ? 1 << 1 : 1 << 6;
+		}
+		case ( 0b11110 << 3 ) | 0b000: // FMV.W.X
+			if( rs2no ) break;
+			*frd = 1;
+			return REG( rs1no );
+	}
+	*trap = (2+1);
+	return 0;
+}
+
+// Xpsimd, packed SIMD on the custom-0 opcode.  funct7 is op << 2 | width,
+// width 0, 1 and 2 for 8, 16 and 32-bit lanes.
+//
+//   funct3 000  PV.LQ vd, imm(rs1)     I-type, vd in rd
+//   funct3 001  PV.SQ vs, imm(rs1)     S-type, vs in rs2
+//   funct3 010  PV.op vd, vs1, vs2     R-type, lanes wrap unless saturating
+//               0 ADD, 1 SUB, 2 MUL (low half), 3 MAC (vd += vs1 * vs2),
+//               4 ADDS, 5 SUBS (signed saturating),
+//               6 ADDUS, 7 SUBUS (unsigned saturating)
+//   funct3 011  0 PV.SPLAT vd, rs1     every lane = rs1
+//               1 PV.REDSUM rd, vs1    rd = sum of the signed lanes
+//
+// Define MINIRV32_PSIMD_ALU( funct7, vd, vs1, vs2 ) to run funct3 010 on a
+// host SIMD unit, it returns 0 for the ops it leaves to MiniRV32PSIMDALU().
+#ifndef MINIRV32_PSIMD_ALU
+	#define MINIRV32_PSIMD_ALU( funct7, vd, vs1, vs2 ) 0
+#endif
+
+#define MINIRV32_PV_LANE( v, i, bits, mask ) ( ( (v)[(i) * (bits) / 32] >> ( (i) * (bits) % 32 ) ) & (mask) )
+#define MINIRV32_PV_SEXT( x, bits ) ( (int32_t)( (x) << ( 32 - (bits) ) ) >> ( 32 - (bits) ) )
+
+static int MiniRV32PSIMDALU( uint32_t funct7, uint32_t * vd, const uint32_t * vs1, const uint32_t * vs2 )
+{
+	if( ( funct7 & 3 ) == 3 || ( funct7 >> 2 ) > 7 )
+		return -1;
+
+	int bits = 8 << ( funct7 & 3 ), i;
+	uint32_t mask = 0xffffffff >> ( 32 - bits ), out[4] = { 0 };
+	int64_t smax = mask >> 1, smin = -smax - 1;
+	for( i = 0; i < 128 / bits; i++ )
+	{
+		uint32_t x = MINIRV32_PV_LANE( vs1, i, bits, mask ), y = MINIRV32_PV_LANE( vs2, i, bits, mask ), r;
+		int64_t s = 0;
+		switch( funct7 >> 2 )
+		{
+			case 0: r = x + y; break; // ADD
+			case 1: r = x - y; break; // SUB
+			case 2: r = x * y; break; // MUL
+			case 3: r = MINIRV32_PV_LANE( vd, i, bits, mask ) + x * y; break; // MAC
+			case 4: s = (int64_t)MINIRV32_PV_SEXT( x, bits ) + MINIRV32_PV_SEXT( y, bits ); // ADDS
+				r = s > smax ? smax : s < smin ? smin : s; break;
+			case 5: s = (int64_t)MINIRV32_PV_SEXT( x, bits ) - MINIRV32_PV_SEXT( y, bits ); // SUBS
+				r = s > smax ? smax : s < smin ? smin : s; break;
+			case 6: r = (uint64_t)x + y > mask ? mask : x + y; break; // ADDUS
+			default: r = x > y ? x - y : 0; break; // SUBUS
+		}
+		out[i * bits / 32] |= ( r & mask ) << ( i * bits % 32 );
+	}
+	memcpy( vd, out, sizeof( out ) );
+	return 0;
+}
+
+// Returns the value for rd and sets *xrd if there is one, or the faulting
+// address with a load or store access fault.
+static uint32_t MiniRV32PSIMD( struct MiniRV32IMAState * state, uint8_t * image, uint32_t ir, uint32_t * trap, int * xrd )
+{
+	uint32_t f3 = ( ir >> 12 ) & 7, f7 = ir >> 25;
+	uint32_t rdno = ( ir >> 7 ) & 0x1f, rs1no = ( ir >> 15 ) & 0x1f, rs2no = ( ir >> 20 ) & 0x1f;
+	uint32_t addy = REG( rs1no ), sum = 0, bits, mask, i;
+
+	switch( f3 )
+	{
+		case 0b000: // PV.LQ
+		case 0b001: // PV.SQ
+		{
+			int is_store = f3 & 1;
+			uint32_t imm = is_store ? ( rdno | ( ( ir >> 20 ) & 0xfe0 ) ) : ( ir >> 20 );
+			uint32_t vno = is_store ? rs2no : rdno;
+			if( vno > 7 ) break;
+			addy += imm | ( ( imm & 0x800 ) ? 0xfffff000 : 0 );
+			addy = MiniRV32Translate( state, image, addy, 16, is_store ? MINIRV32_ACC_STORE : MINIRV32_ACC_LOAD, trap );
+			if( *trap )
+				return addy;
+			uint32_t ofs = addy - MINIRV32_RAM_IMAGE_OFFSET;
+			if( ofs < MINI_RV32_RAM_SIZE - 15 )
+			{
+				if( !is_store )
+					MINIRV32_LOAD16( ofs, state->vregs[vno] );
+				else if( MINIRV32_STORE_DENIED( ofs, 16 ) )
+				{
+					*trap = (7+1);
+					return addy;
+				}
+				else
+					MINIRV32_STORE16( ofs, state->vregs[vno] );
+			}
+#ifdef MINIRV32_SRAM_BASE
+			else if( MINIRV32_IN_SRAM( addy ) && MINIRV32_IN_SRAM( addy + 12 ) )
+			{
+				if( is_store )
+					memcpy( MINIRV32_SRAM + addy - MINIRV32_SRAM_BASE, state->vregs[vno], 16 );
+				else
+					memcpy( state->vregs[vno], MINIRV32_SRAM + addy - MINIRV32_SRAM_BASE, 16 );
+			}
+#endif
+			else
+			{
+				*trap = is_store ? (7+1) : (5+1); // No MMIO, it is 32 bits wide.
+				return addy;
+			}
+			return 0;
+		}
+		case 0b010:
+			if( ( rdno | rs1no | rs2no ) > 7 ) break;
+			if( MINIRV32_PSIMD_ALU( f7, state->vregs[rdno], state->vregs[rs1no], state->vregs[rs2no] ) ||
+				!MiniRV32PSIMDALU( f7, state->vregs[rdno], state->vregs[rs1no], state->vregs[rs2no] ) )
+				return 0;
+			break;
+		case 0b011:
+			if( ( f7 & 3 ) == 3 || rs2no ) break;
+			bits = 8 << ( f7 & 3 );
+			mask = 0xffffffff >> ( 32 - bits );
+			if( ( f7 >> 2 ) == 0 && rdno < 8 ) // PV.SPLAT
+			{
+				uint32_t x = addy & mask;
+				for( i = bits; i < 32; i <<= 1 )
+					x |= x << i;
+				for( i = 0; i < 4; i++ )
+					state->vregs[rdno][i] = x;
+				return 0;
+			}
+			if( ( f7 >> 2 ) == 1 && rs1no < 8 ) // PV.REDSUM
+			{
+				for( i = 0; i < 128 / bits; i++ )
+					sum += MINIRV32_PV_SEXT( MINIRV32_PV_LANE( state->vregs[rs1no], i, bits, mask ), bits );
+				*xrd = 1;
+				return sum;
+			}
+			break;
+	}
+	*trap = (2+1);
+	return 0;
+}
+
+// Zicbom/Zicboz, on the block holding rs1.  Returns the faulting address
+// with a store access fault.
+static uint32_t MiniRV32CBO( struct MiniRV32IMAState * state, uint8_t * image, uint32_t ir, uint32_t * trap )
+{
+	uint32_t op = ir >> 20, cbie = ( CSR( menvcfg ) >> 4 ) & 3;
+	uint32_t addy = REG( ( ir >> 15 ) & 0x1f ) & ~( MINIRV32_CBO_BLOCK - 1 ), ofs;
+
+	if( ( ( ir >> 7 ) & 0x1f ) || ( op > 2 && op != 4 ) )
+	{
+		*trap = (2+1);
+		return 0;
+	}
+	if( ( CSR( extraflags ) & 3 ) != 3 ) // S and U-mode need them enabled, there is no senvcfg.
+	{
+		if( op == 0 ? !cbie : !( CSR( menvcfg ) & ( op == 4 ? 0x80 : 0x40 ) ) )
+		{
+			*trap = (2+1);
+			return 0;
+		}
+		if( op == 0 && cbie == 1 )
+			op = 2; // CBO.INVAL flushes
+	}
+
+	addy = MiniRV32Translate( state, image, addy, MINIRV32_CBO_BLOCK, op == 4 ? MINIRV32_ACC_STORE : MINIRV32_ACC_CBM, trap );
+	if( *trap )
+		return REG( ( ir >> 15 ) & 0x1f );
+	ofs = addy - MINIRV32_RAM_IMAGE_OFFSET;
+
+	// CBO.INVAL and CBO.ZERO can change what memory holds, like stores.
+	if( ofs < MINI_RV32_RAM_SIZE && !( ( op == 0 || op == 4 ) && MINIRV32_STORE_DENIED( ofs, MINIRV32_CBO_BLOCK ) ) )
+	{
+		MINIRV32_CBO( ofs, op );
+		return 0;
+	}
+#ifdef MINIRV32_SRAM_BASE
+	if( MINIRV32_IN_SRAM( addy ) )
+	{
+		if( op == 4 ) memset( MINIRV32_SRAM + addy - MINIRV32_SRAM_BASE, 0, MINIRV32_CBO_BLOCK );
+		return 0;
+	}
+#endif
+	*trap = (7+1);
+	return REG( ( ir >> 15 ) & 0x1f );
+}
+
+// Sstc: with menvcfg.STCE set, mip.STIP follows time >= stimecmp.  Returns
+// STIP, which is left alone (and 0 returned) otherwise.
+static inline uint32_t MiniRV32Sstc( struct MiniRV32IMAState * state )
+{
+	if( !( CSR( menvcfgh ) & 0x80000000 ) )
+		return 0;
+	if( CSR( timerh ) > CSR( stimecmph ) || ( CSR( timerh ) == CSR( stimecmph ) && CSR( timerl ) >= CSR( stimecmpl ) ) )
+		CSR( mip ) |= 1<<5;
+	else
+		CSR( mip ) &= ~(1<<5);
+	return CSR( mip ) & (1<<5);
+}
 
 MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count )
 {
@@ -120,6 +1012,9 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 	else
 		CSR( mip ) &= ~(1<<7);
 
+	if( MiniRV32Sstc( state ) )
+		CSR( extraflags ) &= ~4; // Clear WFI
+
 	// If WFI, don't run processor.
 	if( CSR( extraflags ) & 4 )
 		return 1;
@@ -128,11 +1023,27 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 	uint32_t rval = 0;
 	uint32_t pc = CSR( pc );
 	uint32_t cycle = CSR( cyclel );
+	// The last page instructions were fetched from, until a SYSTEM
+	// instruction may have changed how it translates.
+	uint32_t fetch_vpn = ~0, fetch_ppn = 0;
+
+	if( CSR( mstatus ) & MINIRV32_FS_MASK )
+		feclearexcept( FE_ALL_EXCEPT ); // Anything raised from here on is the guest's.
 
-	if( ( CSR( mip ) & (1<<7) ) && ( CSR( mie ) & (1<<7) /*mtie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
+	// Interrupts for M-mode are enabled below it or with mstatus.MIE, those
+	// delegated to S-mode below that or in it with mstatus.SIE.
+	uint32_t priv = CSR( extraflags ) & 3;
+	uint32_t pending = CSR( mip ) & CSR( mie );
+	pending &= ( ( priv < 3 || ( CSR( mstatus ) & 0x8 /*mie*/ ) ) ? ~CSR( mideleg ) : 0 ) |
+		( ( priv < 1 || ( priv == 1 && ( CSR( mstatus ) & 0x2 /*sie*/ ) ) ) ? CSR( mideleg ) : 0 );
+	if( pending )
 	{
-		// Timer interrupt.
-		trap = 0x80000007;
+		// In priority order: MEI, MSI, MTI, SEI, SSI, STI.
+		static const uint8_t order[] = { 11, 3, 7, 9, 1, 5 };
+		int i = 0;
+		while( !( pending & ( 1 << order[i] ) ) )
+			i++;
+		trap = 0x80000000 | order[i];
 		pc -= 4;
 	}
 	else // No timer interrupt?  Execute a bunch of instructions.
@@ -141,21 +1052,64 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 		uint32_t ir = 0;
 		rval = 0;
 		cycle++;
-		uint32_t ofs_pc = pc - MINIRV32_RAM_IMAGE_OFFSET;
+		uint32_t ppc = pc;
+		uint32_t ilen = 4;
+		int paged = ( CSR( extraflags ) & 3 ) != 3 && ( CSR( satp ) & 0x80000000 ) && !( pc & 1 );
 
-		if( ofs_pc  >= MINI_RV32_RAM_SIZE )
+		if( paged )
+		{
+			if( ( pc >> 12 ) != fetch_vpn )
+			{
+				ppc = MiniRV32Translate( state, image, pc, 2, MINIRV32_ACC_FETCH, &trap );
+				if( trap )
+				{
+					rval = pc;
+					break;
+				}
+				fetch_vpn = pc >> 12;
+				fetch_ppn = ppc >> 12;
+			}
+			ppc = ( fetch_ppn << 12 ) | ( pc & 0xfff );
+		}
+		uint32_t ofs_pc = ppc - MINIRV32_RAM_IMAGE_OFFSET;
+
+		// 4 bytes are fetched even for a 16-bit instruction, so it can't
+		// be in the last 2 bytes of RAM.
+		if( ofs_pc  >= MINI_RV32_RAM_SIZE-3 && !MINIRV32_IN_SRAM( ppc ) )
 		{
 			trap = 1 + 1;  // Handle access violation on instruction read.
 			break;
 		}
-		else if( ofs_pc & 3 )
+		else if( ofs_pc & 1 )
 		{
 			trap = 1 + 0;  //Handle PC-misaligned access
 			break;
 		}
 		else
 		{
-			ir = MINIRV32_LOAD4( ofs_pc );
+#ifdef MINIRV32_SRAM_BASE
+			if( ofs_pc >= MINI_RV32_RAM_SIZE )
+				ir = MiniRV32SRAMLoad( ppc - MINIRV32_SRAM_BASE, 4 );
+			else
+#endif
+			ir = MINIRV32_FETCH4( ofs_pc );
+			if( ( ir & 3 ) != 3 )
+			{
+				ir = MiniRV32ExpandC( ir & 0xffff );
+				ilen = 2;
+			}
+			else if( paged && ( pc & 0xfff ) == 0xffe ) // The upper half is on the next page.
+			{
+				uint32_t hi = MiniRV32Translate( state, image, pc + 2, 2, MINIRV32_ACC_FETCH, &trap ) - MINIRV32_RAM_IMAGE_OFFSET;
+				if( !trap && hi >= MINI_RV32_RAM_SIZE-3 )
+					trap = 1 + 1;
+				if( trap )
+				{
+					rval = pc + 2;
+					break;
+				}
+				ir = ( ir & 0xffff ) | ( MINIRV32_FETCH4( hi ) << 16 );
+			}
 			uint32_t rdid = (ir >> 7) & 0x1f;
 
 			switch( ir & 0x7f )
@@ -170,16 +1124,16 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 				{
 					int32_t reladdy = ((ir & 0x80000000)>>11) | ((ir & 0x7fe00000)>>20) | ((ir & 0x00100000)>>9) | ((ir&0x000ff000));
 					if( reladdy & 0x00100000 ) reladdy |= 0xffe00000; // Sign extension.
-					rval = pc + 4;
-					pc = pc + reladdy - 4;
+					rval = pc + ilen;
+					pc = pc + reladdy - ilen;
 					break;
 				}
 				case 0b1100111: // JALR
 				{
 					uint32_t imm = ir >> 20;
 					int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
-					rval = pc + 4;
-					pc = ( (REG( (ir >> 15) & 0x1f ) + imm_se) & ~1) - 4;
+					rval = pc + ilen;
+					pc = ( (REG( (ir >> 15) & 0x1f ) + imm_se) & ~1) - ilen;
 					break;
 				}
 				case 0b1100011: // Branch
@@ -188,7 +1142,7 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 					if( immm4 & 0x1000 ) immm4 |= 0xffffe000;
 					int32_t rs1 = REG((ir >> 15) & 0x1f);
 					int32_t rs2 = REG((ir >> 20) & 0x1f);
-					immm4 = pc + immm4 - 4;
+					immm4 = pc + immm4 - ilen;
 					rdid = 0;
 					switch( ( ir >> 12 ) & 0x7 )
 					{
@@ -203,23 +1157,61 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 					}
 					break;
 				}
+				case 0b0000111: // FLW
 				case 0b0000011: // Load
 				{
 					uint32_t rs1 = REG((ir >> 15) & 0x1f);
 					uint32_t imm = ir >> 20;
 					int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
 					uint32_t rsval = rs1 + imm_se;
+					uint32_t funct3 = ( ir >> 12 ) & 0x7;
+
+					// Decoded before translation, so a reserved width is an illegal
+					// instruction rather than a page or access fault.
+					if( ( ir & 0b100 ) ? ( funct3 != 0b010 || !( CSR( mstatus ) & MINIRV32_FS_MASK ) ) : !( 0b00110111 & ( 1 << funct3 ) ) ) // LB, LH, LW, LBU, LHU
+					{
+						trap = (2+1);
+						break;
+					}
 
+					rsval = MiniRV32Translate( state, image, rsval, 1 << ( ( ir >> 12 ) & 3 ), MINIRV32_ACC_LOAD, &trap );
+					if( trap )
+					{
+						rval = rsval;
+						break;
+					}
 					rsval -= MINIRV32_RAM_IMAGE_OFFSET;
 					if( rsval >= MINI_RV32_RAM_SIZE-3 )
 					{
 						rsval += MINIRV32_RAM_IMAGE_OFFSET;
+#ifdef MINIRV32_SRAM_BASE
+						if( MINIRV32_IN_SRAM( rsval ) )
+						{
+							rsval -= MINIRV32_SRAM_BASE;
+							switch( ( ir >> 12 ) & 0x7 )
+							{
+								case 0b000: rval = (int8_t)MiniRV32SRAMLoad( rsval, 1 ); break;
+								case 0b001: rval = (int16_t)MiniRV32SRAMLoad( rsval, 2 ); break;
+								case 0b010: rval = MiniRV32SRAMLoad( rsval, 4 ); break;
+								case 0b100: rval = MiniRV32SRAMLoad( rsval, 1 ); break;
+								case 0b101: rval = MiniRV32SRAMLoad( rsval, 2 ); break;
+								default: trap = (2+1);
+							}
+						}
+						else
+#endif
 						if( rsval >= 0x10000000 && rsval < 0x12000000 )  // UART, CLNT
 						{
 							if( rsval == 0x1100bffc ) // https://chromitem-soc.readthedocs.io/en/latest/clint.html
+							{
 								rval = CSR( timerh );
+								MINIRV32_TIMER_STAT( 0 );
+							}
 							else if( rsval == 0x1100bff8 )
+							{
 								rval = CSR( timerl );
+								MINIRV32_TIMER_STAT( 0 );
+							}
 							else
 								MINIRV32_HANDLE_MEM_LOAD_CONTROL( rsval, rval );
 						}
@@ -242,30 +1234,77 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 							default: trap = (2+1);
 						}
 					}
+					if( ir & 0b100 ) // FLW
+					{
+						if( !trap )
+						{
+							FREG( rdid ) = rval;
+							CSR( mstatus ) |= MINIRV32_FS_DIRTY;
+						}
+						rdid = 0;
+					}
 					break;
 				}
+				case 0b0100111: // FSW
 				case 0b0100011: // Store
 				{
 					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t rs2 = REG((ir >> 20) & 0x1f);
+					uint32_t rs2 = ( ir & 0b100 ) ? FREG((ir >> 20) & 0x1f) : REG((ir >> 20) & 0x1f);
 					uint32_t addy = ( ( ir >> 7 ) & 0x1f ) | ( ( ir & 0xfe000000 ) >> 20 );
 					if( addy & 0x800 ) addy |= 0xfffff000;
-					addy += rs1 - MINIRV32_RAM_IMAGE_OFFSET;
+					addy += rs1;
+					uint32_t funct3 = ( ir >> 12 ) & 0x7;
 					rdid = 0;
 
+					// As for loads, decoded before translation.
+					if( ( ir & 0b100 ) ? ( funct3 != 0b010 || !( CSR( mstatus ) & MINIRV32_FS_MASK ) ) : funct3 > 0b010 ) // SB, SH, SW
+					{
+						trap = (2+1);
+						break;
+					}
+
+					addy = MiniRV32Translate( state, image, addy, 1 << ( ( ir >> 12 ) & 3 ), MINIRV32_ACC_STORE, &trap );
+					if( trap )
+					{
+						rval = addy;
+						break;
+					}
+					addy -= MINIRV32_RAM_IMAGE_OFFSET;
+
 					if( addy >= MINI_RV32_RAM_SIZE-3 )
 					{
 						addy += MINIRV32_RAM_IMAGE_OFFSET;
+#ifdef MINIRV32_SRAM_BASE
+						if( MINIRV32_IN_SRAM( addy ) )
+						{
+							switch( ( ir >> 12 ) & 0x7 )
+							{
+								//SB, SH, SW
+								case 0b000: MiniRV32SRAMStore( addy - MINIRV32_SRAM_BASE, rs2, 1 ); break;
+								case 0b001: MiniRV32SRAMStore( addy - MINIRV32_SRAM_BASE, rs2, 2 ); break;
+								case 0b010: MiniRV32SRAMStore( addy - MINIRV32_SRAM_BASE, rs2, 4 ); break;
+								default: trap = (2+1);
+							}
+						}
+						else
+#endif
 						if( addy >= 0x10000000 && addy < 0x12000000 )
 						{
 							// Should be stuff like SYSCON, 8250, CLNT
 							if( addy == 0x11004004 ) //CLNT
+							{
 								CSR( timermatchh ) = rs2;
+								MINIRV32_TIMER_STAT( 1 );
+							}
 							else if( addy == 0x11004000 ) //CLNT
+							{
 								CSR( timermatchl ) = rs2;
+								MINIRV32_TIMER_STAT( 1 );
+							}
 							else if( addy == 0x11100000 ) //SYSCON (reboot, poweroff, etc.)
 							{
-								SETCSR( pc, pc + 4 );
+								MiniRV32FFlagsSync( state );
+								SETCSR( pc, pc + ilen );
 								return rs2; // NOTE: PC will be PC of Syscon.
 							}
 							else
@@ -277,6 +1316,11 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 							rval = addy;
 						}
 					}
+					else if( MINIRV32_STORE_DENIED( addy, 1 << ( ( ir >> 12 ) & 3 ) ) )
+					{
+						trap = (7+1); // Store access fault.
+						rval = addy + MINIRV32_RAM_IMAGE_OFFSET;
+					}
 					else
 					{
 						switch( ( ir >> 12 ) & 0x7 )
@@ -299,7 +1343,7 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 					uint32_t is_reg = !!( ir & 0b100000 );
 					uint32_t rs2 = is_reg ? REG(imm & 0x1f) : imm;
 
-					if( is_reg && ( ir & 0x02000000 ) )
+					if( is_reg && ( ir >> 25 ) == 0b0000001 )
 					{
 						switch( (ir>>12)&7 ) //0x02000000 = RV32M
 						{
@@ -313,8 +1357,24 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 							case 0b111: if( rs2 == 0 ) rval = rs1; else rval = rs1 % rs2; break; // REMU
 						}
 					}
+					// Any other funct7 than 0 or 0b0100000 (SUB/SRA/SRAI) on OP or the OP-IMM
+					// shifts, or ANDN/ORN/XNOR, is bit manipulation.
+					else if( ( is_reg || ( ( ir >> 12 ) & 3 ) == 1 ) &&
+						( ( ir & 0xbe000000 ) || ( is_reg && ( ir & 0x40000000 ) && ( ( 0xd0 >> ( ( ir >> 12 ) & 7 ) ) & 1 ) ) ) )
+					{
+						rval = MiniRV32Bitmanip( ir, rs1, rs2, &trap );
+					}
 					else
 					{
+						// Zicbop, hints on ORI x0 with the low offset bits 0, 1 or 3.
+						if( !is_reg && !rdid && ( ( ir >> 12 ) & 7 ) == 0b110 && ( imm & 0x1f ) < 4 && ( imm & 0x1f ) != 2 )
+						{
+							// Never faults, 0 (.I), 1 (.R) and 3 (.W) check fetch, load and store permission.
+							uint32_t fault = 0, op = imm & 0x1f;
+							uint32_t ofs = MiniRV32Translate( state, image, rs1 + ( imm & ~0x1f ), 1, op - ( op >> 1 ), &fault ) - MINIRV32_RAM_IMAGE_OFFSET;
+							if( !fault && ofs < MINI_RV32_RAM_SIZE )
+								MINIRV32_PREFETCH( ofs, op );
+						}
 						switch( (ir>>12)&7 ) // These could be either op-immediate or op commands.  Be careful.
 						{
 							case 0b000: rval = (is_reg && (ir & 0x40000000) ) ? ( rs1 - rs2 ) : ( rs1 + rs2 ); break; 
@@ -329,19 +1389,76 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 					}
 					break;
 				}
+				case 0b1010011: // OP-FP
+				case 0b1000011: // FMADD.S
+				case 0b1000111: // FMSUB.S
+				case 0b1001011: // FNMSUB.S
+				case 0b1001111: // FNMADD.S
+				{
+					int frd = 0;
+					rval = MiniRV32FP( state, ir, &frd, &trap );
+					if( frd )
+					{
+						if( !trap ) FREG( rdid ) = rval;
+						rdid = 0;
+					}
+					break;
+				}
+				case 0b0001011: // custom-0, Xpsimd
+				{
+					int xrd = 0;
+					rval = MiniRV32PSIMD( state, image, ir, &trap, &xrd );
+					if( !xrd ) rdid = 0;
+					break;
+				}
 				case 0b0001111:
+					if( ( ( ir >> 12 ) & 0b111 ) == 0b010 ) // Zicbom/Zicboz
+						rval = MiniRV32CBO( state, image, ir, &trap );
+					else if( ir == 0x0100000f ) // Zihintpause PAUSE, a FENCE W,0
+					{
+						if( CSR( cyclel ) > cycle ) CSR( cycleh )++;
+						SETCSR( cyclel, cycle );
+						MiniRV32FFlagsSync( state );
+						SETCSR( pc, pc + ilen );
+						return MINIRV32_PAUSE;
+					}
 					rdid = 0;   // fencetype = (ir >> 12) & 0b111; We ignore fences in this impl.
 					break;
 				case 0b1110011: // Zifencei+Zicsr
 				{
 					uint32_t csrno = ir >> 20;
 					int microop = ( ir >> 12 ) & 0b111;
+					fetch_vpn = ~0; // Any of these may change the translation of pc.
+					priv = CSR( extraflags ) & 3;
 					if( (microop & 3) ) // It's a Zicsr function.
 					{
 						int rs1imm = (ir >> 15) & 0x1f;
 						uint32_t rs1 = REG(rs1imm);
 						uint32_t writeval = rs1;
 
+						if( csrno >= 0x001 && csrno <= 0x003 && !( CSR( mstatus ) & MINIRV32_FS_MASK ) )
+						{
+							trap = (2+1); // fflags, frm, fcsr with FS Off
+							break;
+						}
+						// CSR bits 9:8 are the lowest privilege allowed, 11:10 = 3 are read-only.
+						if( ( ( csrno >> 8 ) & 3 ) > priv || ( ( csrno >> 10 ) == 3 && ( microop == 0b001 || microop == 0b101 || rs1imm ) ) )
+						{
+							trap = (2+1);
+							break;
+						}
+						// Counters below M-mode need mcounteren, and scounteren in U-mode,
+						// stimecmp in S-mode mcounteren.TM and menvcfg.STCE, and satp
+						// mstatus.TVM clear.
+						if( priv < 3 && (
+							( ( csrno & 0xf60 ) == 0xc00 && !( ( CSR( mcounteren ) & ( priv ? ~0 : CSR( scounteren ) ) ) >> ( csrno & 0x1f ) & 1 ) ) ||
+							( ( csrno == 0x14d || csrno == 0x15d ) && ( !( CSR( mcounteren ) & 2 ) || !( CSR( menvcfgh ) & 0x80000000 ) ) ) ||
+							( csrno == 0x180 && ( CSR( mstatus ) & MINIRV32_MSTATUS_TVM ) ) ) )
+						{
+							trap = (2+1);
+							break;
+						}
+
 						// https://raw.githubusercontent.com/riscv/virtual-memory/main/specs/663-Svpbmt.pdf
 						// Generally, support for Zicsr
 						switch( csrno )
@@ -350,13 +1467,38 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 						case 0x305: rval = CSR( mtvec ); break;
 						case 0x304: rval = CSR( mie ); break;
 						case 0xC00: rval = cycle; break;
+						case 0xC80: rval = CSR( cycleh ) + ( cycle < CSR( cyclel ) ); break; //cycleh, carry from this step
+						case 0xC01: rval = CSR( timerl ); MINIRV32_TIMER_STAT( 2 ); break; //time
+						case 0xC81: rval = CSR( timerh ); MINIRV32_TIMER_STAT( 2 ); break; //timeh
+						case 0xC02: rval = cycle; break; //instret, one cycle per instruction
+						case 0xC82: rval = CSR( cycleh ) + ( cycle < CSR( cyclel ) ); break; //instreth
+						case 0x14d: rval = CSR( stimecmpl ); break; //stimecmp
+						case 0x15d: rval = CSR( stimecmph ); break; //stimecmph
+						case 0x31a: rval = CSR( menvcfgh ); break; //menvcfgh
+						case 0x302: rval = CSR( medeleg ); break;
+						case 0x303: rval = CSR( mideleg ); break;
+						case 0x306: rval = CSR( mcounteren ); break;
+						case 0x100: rval = CSR( mstatus ) & MINIRV32_SSTATUS; break; //sstatus
+						case 0x104: rval = CSR( mie ) & CSR( mideleg ); break; //sie
+						case 0x144: rval = CSR( mip ) & CSR( mideleg ); break; //sip
+						case 0x105: rval = CSR( stvec ); break;
+						case 0x106: rval = CSR( scounteren ); break;
+						case 0x140: rval = CSR( sscratch ); break;
+						case 0x141: rval = CSR( sepc ); break;
+						case 0x142: rval = CSR( scause ); break;
+						case 0x143: rval = CSR( stval ); break;
+						case 0x180: rval = CSR( satp ); break;
 						case 0x344: rval = CSR( mip ); break;
 						case 0x341: rval = CSR( mepc ); break;
 						case 0x300: rval = CSR( mstatus ); break; //mstatus
+						case 0x30a: rval = CSR( menvcfg ); break; //menvcfg
 						case 0x342: rval = CSR( mcause ); break;
 						case 0x343: rval = CSR( mtval ); break;
+						case 0x001: MiniRV32FFlagsSync( state ); rval = CSR( fcsr ) & 0x1f; break; //fflags
+						case 0x002: rval = CSR( fcsr ) >> 5; break; //frm
+						case 0x003: MiniRV32FFlagsSync( state ); rval = CSR( fcsr ); break; //fcsr
 						case 0xf11: rval = 0xff0ff0ff; break; //mvendorid
-						case 0x301: rval = 0x40401101; break; //misa (XLEN=32, IMA+X)
+						case 0x301: rval = 0x40541127; break; //misa (XLEN=32, IMAFBCSU+X)
 						//case 0x3B0: rval = 0; break; //pmpaddr0
 						//case 0x3a0: rval = 0; break; //pmpcfg0
 						//case 0xf12: rval = 0x00000000; break; //marchid
@@ -377,15 +1519,43 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 							case 0b111: writeval = rval & ~rs1imm; break;	//CSRRCI
 						}
 
+						// CSRRS/CSRRC with x0 and CSRRSI/CSRRCI with 0 only read.
+						if( ( microop & 0b010 ) && !rs1imm ) break;
+
 						switch( csrno )
 						{
 						case 0x340: SETCSR( mscratch, writeval ); break;
 						case 0x305: SETCSR( mtvec, writeval ); break;
 						case 0x304: SETCSR( mie, writeval ); break;
-						case 0x344: SETCSR( mip, writeval ); break;
+						case 0x344: //mip, SSIP and STIP (unless Sstc drives it)
+						{
+							uint32_t m = ( CSR( menvcfgh ) & 0x80000000 ) ? 0x2 : 0x22;
+							SETCSR( mip, ( CSR( mip ) & ~m ) | ( writeval & m ) );
+							break;
+						}
 						case 0x341: SETCSR( mepc, writeval ); break;
-						case 0x300: SETCSR( mstatus, writeval ); break; //mstatus
+						case 0x300: SETCSR( mstatus, MINIRV32_WITH_SD( ( writeval & 0x1800 ) == 0x1000 ? writeval & ~0x1800 : writeval ) ); break; //mstatus, SD = FS is Dirty, MPP 2 is reserved
+						case 0x302: SETCSR( medeleg, writeval & 0xb3ff ); break; //medeleg, not ECALL from M-mode
+						case 0x303: SETCSR( mideleg, writeval & 0x222 ); break; //mideleg, the S interrupts
+						case 0x306: SETCSR( mcounteren, writeval & 7 ); break;
+						case 0x100: SETCSR( mstatus, MINIRV32_WITH_SD( ( CSR( mstatus ) & ~MINIRV32_SSTATUS ) | ( writeval & MINIRV32_SSTATUS & ~0x80000000 ) ) ); break; //sstatus
+						case 0x104: SETCSR( mie, ( CSR( mie ) & ~CSR( mideleg ) ) | ( writeval & CSR( mideleg ) ) ); break; //sie
+						case 0x144: SETCSR( mip, ( CSR( mip ) & ~( CSR( mideleg ) & 2 ) ) | ( writeval & CSR( mideleg ) & 2 ) ); break; //sip, SSIP
+						case 0x105: SETCSR( stvec, writeval & ~2 ); break;
+						case 0x106: SETCSR( scounteren, writeval & 7 ); break;
+						case 0x140: SETCSR( sscratch, writeval ); break;
+						case 0x141: SETCSR( sepc, writeval & ~1 ); break;
+						case 0x142: SETCSR( scause, writeval ); break;
+						case 0x143: SETCSR( stval, writeval ); break;
+						case 0x180: SETCSR( satp, writeval ); break;
 						case 0x342: SETCSR( mcause, writeval ); break;
+						case 0x30a: SETCSR( menvcfg, writeval & ( ( writeval & 0x30 ) == 0x20 ? 0xc0 : 0xf0 ) ); break; //menvcfg, CBIE 10 is reserved
+						case 0x31a: SETCSR( menvcfgh, writeval & 0x80000000 ); if( !MiniRV32Sstc( state ) ) CSR( mip ) &= ~(1<<5); break; //menvcfgh, STCE
+						case 0x14d: SETCSR( stimecmpl, writeval ); MiniRV32Sstc( state ); MINIRV32_TIMER_STAT( 3 ); break; //stimecmp
+						case 0x15d: SETCSR( stimecmph, writeval ); MiniRV32Sstc( state ); MINIRV32_TIMER_STAT( 3 ); break; //stimecmph
+						case 0x001: MiniRV32FCSRWrite( state, ( CSR( fcsr ) & ~0x1f ) | ( writeval & 0x1f ) ); break; //fflags
+						case 0x002: MiniRV32FCSRWrite( state, ( CSR( fcsr ) & 0x1f ) | ( ( writeval & 7 ) << 5 ) ); break; //frm
+						case 0x003: MiniRV32FCSRWrite( state, writeval ); break; //fcsr
 						case 0x343: SETCSR( mtval, writeval ); break;
 						//case 0x3a0: break; //pmpcfg0
 						//case 0x3B0: break; //pmpaddr0
@@ -402,29 +1572,71 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 					else if( microop == 0b000 ) // "SYSTEM"
 					{
 						rdid = 0;
-						if( csrno == 0x105 ) //WFI (Wait for interrupts)
+						if( ( csrno == 0x105 || csrno == 0x00d ) && priv < 3 && ( CSR( mstatus ) & MINIRV32_MSTATUS_TW ) )
+						{
+							trap = (2+1); // WFI and WRS.NTO with mstatus.TW
+						}
+						else if( csrno == 0x105 ) //WFI (Wait for interrupts)
 						{
 							CSR( mstatus ) |= 8;    //Enable interrupts
 							CSR( extraflags ) |= 4; //Infor environment we want to go to sleep.
-							SETCSR( pc, pc + 4 );
+							MiniRV32FFlagsSync( state );
+							SETCSR( pc, pc + ilen );
 							return 1;
 						}
-						else if( ( ( csrno & 0xff ) == 0x02 ) )  // MRET
+						else if( ( csrno == 0x00d || csrno == 0x01d ) && !( ( ir >> 7 ) & 0x1fff ) ) // Zawrs WRS.NTO, WRS.STO
+						{
+							// Without a reservation, or with an interrupt pending, it ends at once.
+							if( ( CSR( extraflags ) >> 3 ) != MINIRV32_NO_RESERVATION && !( CSR( mip ) & CSR( mie ) ) )
+							{
+								if( CSR( cyclel ) > cycle ) CSR( cycleh )++;
+								SETCSR( cyclel, cycle );
+								MiniRV32FFlagsSync( state );
+								SETCSR( pc, pc + ilen );
+								return csrno == 0x00d ? MINIRV32_WRS_NTO : MINIRV32_WRS_STO;
+							}
+						}
+						else if( ( csrno >> 5 ) == 0b0001001 && !( ( ir >> 7 ) & 0x1f ) ) // SFENCE.VMA
+						{
+							uint32_t rs1no = ( ir >> 15 ) & 0x1f, rs2no = ( ir >> 20 ) & 0x1f;
+							if( priv == 0 || ( priv == 1 && ( CSR( mstatus ) & MINIRV32_MSTATUS_TVM ) ) )
+								trap = (2+1);
+							else
+								MINIRV32_TLB_FLUSH( REG( rs1no ), REG( rs2no ) & 0x1ff, ( rs1no ? 1 : 0 ) | ( rs2no ? 2 : 0 ) );
+						}
+						else if( csrno == 0x302 )  // MRET
 						{
 							//https://raw.githubusercontent.com/riscv/virtual-memory/main/specs/663-Svpbmt.pdf
 							//Table 7.6. MRET then in mstatus/mstatush sets MPV=0, MPP=0, MIE=MPIE, and MPIE=1. La
 							// Should also update mstatus to reflect correct mode.
 							uint32_t startmstatus = CSR( mstatus );
-							uint32_t startextraflags = CSR( extraflags );
-							SETCSR( mstatus , (( startmstatus & 0x80) >> 4) | ((startextraflags&3) << 11) | 0x80 );
-							SETCSR( extraflags, (startextraflags & ~3) | ((startmstatus >> 11) & 3) );
-							pc = CSR( mepc ) -4;
+							uint32_t mpp = ( startmstatus >> 11 ) & 3;
+							if( priv < 3 )
+								trap = (2+1);
+							else
+							{
+								SETCSR( mstatus, ( startmstatus & ~( 0x1888 | ( mpp < 3 ? MINIRV32_MSTATUS_MPRV : 0 ) ) ) | (( startmstatus & 0x80) >> 4) | 0x80 );
+								SETCSR( extraflags, (CSR( extraflags ) & ~3) | mpp );
+								pc = CSR( mepc ) - ilen;
+							}
+						}
+						else if( csrno == 0x102 )  // SRET: SIE=SPIE, SPIE=1, SPP=U
+						{
+							uint32_t startmstatus = CSR( mstatus );
+							if( priv == 0 || ( priv == 1 && ( startmstatus & MINIRV32_MSTATUS_TSR ) ) )
+								trap = (2+1);
+							else
+							{
+								SETCSR( mstatus, ( startmstatus & ~( 0x122 | MINIRV32_MSTATUS_MPRV ) ) | (( startmstatus & 0x20) >> 4) | 0x20 );
+								SETCSR( extraflags, (CSR( extraflags ) & ~3) | ( ( startmstatus >> 8 ) & 1 ) );
+								pc = CSR( sepc ) - ilen;
+							}
 						}
 						else
 						{
 							switch( csrno )
 							{
-							case 0: trap = ( CSR( extraflags ) & 3) ? (11+1) : (8+1); break; // ECALL; 8 = "Environment call from U-mode"; 11 = "Environment call from M-mode"
+							case 0: trap = 8 + priv + 1; break; // ECALL; 8 = "Environment call from U-mode"; 9 from S-mode, 11 from M-mode
 							case 1:	trap = (3+1); break; // EBREAK 3 = "Breakpoint"
 							default: trap = (2+1); break; // Illegal opcode.
 							}
@@ -440,15 +1652,79 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 					uint32_t rs2 = REG((ir >> 20) & 0x1f);
 					uint32_t irmid = ( ir>>27 ) & 0x1f;
 
+					// LR.W faults like a load, SC.W and the AMOs like stores.
+					rs1 = MiniRV32Translate( state, image, rs1, 4, irmid == 0b00010 ? MINIRV32_ACC_LOAD : MINIRV32_ACC_STORE, &trap );
+					if( trap )
+					{
+						rval = rs1;
+						break;
+					}
 					rs1 -= MINIRV32_RAM_IMAGE_OFFSET;
 
 					// We don't implement load/store from UART or CLNT with RV32A here.
 
+#ifdef MINIRV32_SRAM_BASE
+					if( MINIRV32_IN_SRAM( rs1 + MINIRV32_RAM_IMAGE_OFFSET ) )
+					{
+						int illegal = 0;
+						if( rs1 & 3 )
+						{
+							trap = irmid == 0b00010 ? (4+1) : (6+1); //Load or Store/AMO address misaligned
+							rval = rs1 + MINIRV32_RAM_IMAGE_OFFSET;
+						}
+						else
+						{
+							rval = MiniRV32SRAMAMO( rs1 + MINIRV32_RAM_IMAGE_OFFSET - MINIRV32_SRAM_BASE, irmid, rs2, CSR( extraflags ) >> 3, rs1, &illegal );
+							if( illegal )
+								trap = (2+1);
+							else if( irmid == 0b00010 ) //LR.W
+								CSR( extraflags ) = (CSR( extraflags ) & 0b111) | (rs1<<3);
+						}
+					}
+					else
+#endif
 					if( rs1 >= MINI_RV32_RAM_SIZE-3 )
 					{
 						trap = (7+1); //Store/AMO access fault
 						rval = rs1 + MINIRV32_RAM_IMAGE_OFFSET;
 					}
+					else if( irmid != 0b00010 && MINIRV32_STORE_DENIED( rs1, 4 ) )
+					{
+						trap = (7+1); //Store/AMO access fault
+						rval = rs1 + MINIRV32_RAM_IMAGE_OFFSET;
+					}
+#ifdef MINIRV32_AMO4
+					else if( rs1 & 3 )
+					{
+						trap = irmid == 0b00010 ? (4+1) : (6+1); //Load or Store/AMO address misaligned
+						rval = rs1 + MINIRV32_RAM_IMAGE_OFFSET;
+					}
+					else
+					{
+						// The memory bus does the whole read-modify-write (and the
+						// SC.W reservation check) with a single access.
+						switch( irmid )
+						{
+							case 0b00010: //LR.W
+								rval = MINIRV32_AMO4( rs1, irmid, 0, 0 );
+								CSR( extraflags ) = (CSR( extraflags ) & 0b111) | (rs1<<3);
+								break;
+							case 0b00011: //SC.W
+							case 0b00001: //AMOSWAP.W
+							case 0b00000: //AMOADD.W
+							case 0b00100: //AMOXOR.W
+							case 0b01100: //AMOAND.W
+							case 0b01000: //AMOOR.W
+							case 0b10000: //AMOMIN.W
+							case 0b10100: //AMOMAX.W
+							case 0b11000: //AMOMINU.W
+							case 0b11100: //AMOMAXU.W
+								rval = MINIRV32_AMO4( rs1, irmid, rs2, CSR( extraflags ) >> 3 );
+								break;
+							default: trap = (2+1); break; //Not supported.
+						}
+					}
+#else
 					else
 					{
 						rval = MINIRV32_LOAD4( rs1 );
@@ -478,6 +1754,10 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 						}
 						if( dowrite ) MINIRV32_STORE4( rs1, rs2 );
 					}
+#endif
+					// SC.W gives up the reservation, whether it stored or not.
+					if( irmid == 0b00011 && !trap )
+						CSR( extraflags ) = (CSR( extraflags ) & 0b111) | (MINIRV32_NO_RESERVATION<<3);
 					break;
 				}
 				default: trap = (2+1); // Fault: Invalid opcode.
@@ -495,39 +1775,58 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 
 		MINIRV32_POSTEXEC( pc, ir, trap );
 
-		pc += 4;
+		pc += ilen;
 	}
 
 	// Handle traps and interrupts.
 	if( trap )
 	{
+		uint32_t cause, tval, tvec;
+		priv = CSR( extraflags ) & 3;
 		if( trap & 0x80000000 ) // If prefixed with 1 in MSB, it's an interrupt, not a trap.
 		{
-			SETCSR( mcause, trap );
-			SETCSR( mtval, 0 );
+			cause = trap;
+			tval = 0;
 			pc += 4; // PC needs to point to where the PC will return to.
 		}
 		else
 		{
-			SETCSR( mcause,  trap - 1 );
-			SETCSR( mtval, (trap > 5 && trap <= 8)? rval : pc );
+			// Misaligned, access and page faults report the address.
+			cause = trap - 1;
+			tval = ( ( trap > 4 && trap <= 8 ) || trap > 12 ) ? rval : pc;
 		}
-		SETCSR( mepc, pc ); //TRICKY: The kernel advances mepc automatically.
-		//CSR( mstatus ) & 8 = MIE, & 0x80 = MPIE
-		// On an interrupt, the system moves current MIE into MPIE
-		SETCSR( mstatus, (( CSR( mstatus ) & 0x08) << 4) | (( CSR( extraflags ) & 3 ) << 11) );
-		pc = (CSR( mtvec ) - 4);
-
-		// If trapping, always enter machine mode.
-		CSR( extraflags ) |= 3;
 
+		// Below M-mode, traps delegated in medeleg/mideleg go to S-mode.
+		if( priv < 3 && ( ( ( trap & 0x80000000 ) ? CSR( mideleg ) : CSR( medeleg ) ) >> ( cause & 0x1f ) & 1 ) )
+		{
+			SETCSR( scause, cause );
+			SETCSR( stval, tval );
+			SETCSR( sepc, pc );
+			// SPIE = SIE, SIE = 0, SPP = the previous mode.
+			SETCSR( mstatus, ( CSR( mstatus ) & ~0x122 ) | (( CSR( mstatus ) & 0x2) << 4) | ( priv << 8 ) );
+			SETCSR( extraflags, ( CSR( extraflags ) & ~3 ) | 1 );
+			tvec = CSR( stvec );
+		}
+		else
+		{
+			SETCSR( mcause, cause );
+			SETCSR( mtval, tval );
+			SETCSR( mepc, pc ); //TRICKY: The kernel advances mepc automatically.
+			//CSR( mstatus ) & 8 = MIE, & 0x80 = MPIE
+			// On an interrupt, the system moves current MIE into MPIE
+			SETCSR( mstatus, ( CSR( mstatus ) & ~0x1888 ) | (( CSR( mstatus ) & 0x08) << 4) | ( priv << 11 ) );
+			CSR( extraflags ) |= 3;
+			tvec = CSR( mtvec );
+		}
+		// Vectored mode sends interrupts to base + 4 * cause.
+		pc = ( tvec & ~3 ) + ( ( ( tvec & 1 ) && ( trap & 0x80000000 ) ) ? 4 * ( cause & 0x1f ) : 0 );
 		trap = 0;
-		pc += 4;
 	}
 
 	if( CSR( cyclel ) > cycle ) CSR( cycleh )++;
 	SETCSR( cyclel, cycle );
 	SETCSR( pc, pc );
+	MiniRV32FFlagsSync( state );
 	return 0;
 }
 
@@ -0,0 +1,64 @@
+/*
+ * Xpsimd lane operations on the ESP32-S3 PIE vector unit.
+ *
+ * The PIE only has the signed saturating adds and subtracts among the
+ * Xpsimd ops; its multiplies shift and saturate their products, and it has
+ * no wrapping or unsigned saturating adds. Everything it can't do, and
+ * everything on other targets, is left to the C in emulator.h.
+ *
+ * Each op loads its operands into q0 and q1 and stores q2 within a single
+ * asm statement, so no q register holds guest state between two ops. Only
+ * the emulator task uses the PIE, so nothing else can clobber them while
+ * the statement runs.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pie.h"
+
+#if PIE_XPSIMD
+/* EE.VLD.128 and EE.VST.128 ignore the low 4 address bits */
+static uint32_t q[3][4] __attribute__((aligned(16)));
+
+#define PIE_OP(insn)							\
+	__asm__ volatile("ee.vld.128.ip q0, %0, 0\n\t"			\
+			 "ee.vld.128.ip q1, %1, 0\n\t"			\
+			 insn " q2, q0, q1\n\t"				\
+			 "ee.vst.128.ip q2, %2, 0"			\
+			 : "+r"(a), "+r"(b), "+r"(d) : : "memory")
+
+int pie_alu(uint32_t funct7, uint32_t *vd, const uint32_t *vs1, const uint32_t *vs2)
+{
+	uint32_t *a = q[0], *b = q[1], *d = q[2];
+
+	memcpy(a, vs1, sizeof(q[0]));
+	memcpy(b, vs2, sizeof(q[1]));
+	switch (funct7) {
+	case PIE_PV_FUNCT7(PIE_PV_ADDS, 0):
+		PIE_OP("ee.vadds.s8");
+		break;
+	case PIE_PV_FUNCT7(PIE_PV_ADDS, 1):
+		PIE_OP("ee.vadds.s16");
+		break;
+	case PIE_PV_FUNCT7(PIE_PV_ADDS, 2):
+		PIE_OP("ee.vadds.s32");
+		break;
+	case PIE_PV_FUNCT7(PIE_PV_SUBS, 0):
+		PIE_OP("ee.vsubs.s8");
+		break;
+	case PIE_PV_FUNCT7(PIE_PV_SUBS, 1):
+		PIE_OP("ee.vsubs.s16");
+		break;
+	case PIE_PV_FUNCT7(PIE_PV_SUBS, 2):
+		PIE_OP("ee.vsubs.s32");
+		break;
+	default:
+		return 0;
+	}
+	memcpy(vd, q[2], sizeof(q[2]));
+	return 1;
+}
+#endif
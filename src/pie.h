@@ -0,0 +1,32 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef PIE_H
+#define PIE_H
+
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+/*
+ * Run the Xpsimd ops the PIE has on it, on by default where there is one.
+ * Build with -DPIE_XPSIMD=0 to leave every op to the C lane loop.
+ */
+#if !defined(PIE_XPSIMD) && CONFIG_IDF_TARGET_ESP32S3
+#define PIE_XPSIMD		1
+#endif
+#if PIE_XPSIMD && !CONFIG_IDF_TARGET_ESP32S3
+#error "PIE_XPSIMD needs the PIE of the ESP32-S3"
+#endif
+
+/* Xpsimd funct7 (op << 2 | width) done by the PIE, see emulator.h */
+#define PIE_PV_ADDS		4
+#define PIE_PV_SUBS		5
+#define PIE_PV_FUNCT7(op, w)	((op) << 2 | (w))
+
+int pie_alu(uint32_t funct7, uint32_t *vd, const uint32_t *vs1, const uint32_t *vs2);
+
+#endif /* PIE_H */
@@ -7,7 +7,7 @@
 #ifndef PSRAM_H
 #define PSRAM_H
 
-#include "driver/spi_master.h"
+#include <stdint.h>
 
 int psram_init(void);
 int psram_read(uint32_t addr, void *buf, int len);
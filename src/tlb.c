@@ -0,0 +1,199 @@
+/*
+ * Software TLB for the guest's Sv32 translations.
+ *
+ * TLB_SETS sets of TLB_WAYS entries, indexed by the low bits of the virtual
+ * page number and tagged with it and the ASID of satp. Global translations
+ * match any ASID. A superpage is cached as the 4 KiB pages in use, each
+ * entry marked as such so that flushing any address of the superpage drops
+ * them all. Ways are replaced round robin.
+ *
+ * Walks read the page table through the cache, where the PTEs of hot page
+ * tables stay resident. A walk is timed from its first PTE read to the fill,
+ * walks that fault are not.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "cache.h"
+#include "tlb.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_cpu.h"
+#include "esp_log.h"
+#define tlb_clock()	esp_cpu_get_cycle_count()
+#else
+#include <stdio.h>
+#include <time.h>
+#define ESP_LOGI(tag, fmt, ...)	printf("I %s: " fmt "\n", tag, ##__VA_ARGS__)
+static inline uint32_t tlb_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+#define TAG "tlb"
+
+#define PTE_G		0x20
+
+struct tlb_entry {
+	uint32_t tag;		/* virtual page number + 1, 0 if free */
+	uint32_t pte;		/* leaf PTE, PPN of the 4 KiB page */
+	uint16_t asid;
+	uint8_t super;		/* part of a superpage */
+};
+
+static struct tlb_entry tlb[TLB_SETS][TLB_WAYS];
+static uint8_t next_way[TLB_SETS];
+/* superpage entries, flushes by address search all sets while there are any */
+static uint32_t nr_super;
+static uint32_t walk_start;
+static int walking;
+static struct tlb_stats stats;
+
+static inline int tlb_match(const struct tlb_entry *e, uint32_t vpn, uint32_t asid)
+{
+	return e->tag == vpn + 1 && (e->asid == asid || (e->pte & PTE_G));
+}
+
+/* Returns 1 with the cached leaf PTE for the page of va, 0 on a miss. */
+int tlb_lookup(uint32_t va, uint32_t asid, uint32_t *pte)
+{
+	uint32_t vpn = va >> 12;
+	struct tlb_entry *e = tlb[vpn % TLB_SETS];
+	int i;
+
+	walking = 0;
+	for (i = 0; i < TLB_WAYS; i++, e++) {
+		if (tlb_match(e, vpn, asid)) {
+			*pte = e->pte;
+			++stats.hits;
+			return 1;
+		}
+	}
+	++stats.misses;
+	return 0;
+}
+
+/* A page table read of the walk after tlb_lookup(). */
+uint32_t tlb_pte_load(uint32_t ofs)
+{
+	uint32_t pte;
+
+	if (!walking) {
+		walking = 1;
+		walk_start = tlb_clock();
+	}
+	cache_read(ofs, &pte, 4);
+	++stats.pte_reads;
+	return pte;
+}
+
+/*
+ * Cache the translation of va found by a walk. It replaces the entry it was
+ * walked again for, if any.
+ */
+void tlb_fill(uint32_t va, uint32_t asid, uint32_t pte, int super)
+{
+	uint32_t vpn = va >> 12, set = vpn % TLB_SETS;
+	struct tlb_entry *e = NULL;
+	int i, bucket;
+
+	for (i = 0; i < TLB_WAYS && !e; i++) {
+		if (tlb_match(&tlb[set][i], vpn, asid))
+			e = &tlb[set][i];
+	}
+	if (!e) {
+		e = &tlb[set][next_way[set]];
+		next_way[set] = (next_way[set] + 1) % TLB_WAYS;
+		if (e->tag)
+			++stats.evictions;
+	}
+	if (e->tag && e->super)
+		nr_super--;
+	e->tag = vpn + 1;
+	e->pte = pte;
+	e->asid = asid;
+	e->super = super;
+	if (super)
+		nr_super++;
+	++stats.fills;
+
+	if (walking) {
+		bucket = 31 - __builtin_clz((tlb_clock() - walk_start) | 1);
+		if (bucket >= TLB_LAT_BUCKETS)
+			bucket = TLB_LAT_BUCKETS - 1;
+		++stats.walk_lat[bucket];
+		walking = 0;
+	}
+}
+
+static int tlb_flush_match(const struct tlb_entry *e, uint32_t vpn, uint32_t asid, int flags)
+{
+	if (!e->tag)
+		return 0;
+	if ((flags & TLB_FLUSH_VA) &&
+	    (e->super ? (e->tag - 1) >> 10 != vpn >> 10 : e->tag - 1 != vpn))
+		return 0;
+	if ((flags & TLB_FLUSH_ASID) && ((e->pte & PTE_G) || e->asid != asid))
+		return 0;
+	return 1;
+}
+
+/* SFENCE.VMA, with flags from TLB_FLUSH_VA and TLB_FLUSH_ASID. */
+void tlb_flush(uint32_t va, uint32_t asid, int flags)
+{
+	uint32_t vpn = va >> 12, set, first = 0, last = TLB_SETS - 1;
+	struct tlb_entry *e;
+	int i;
+
+	++stats.flushes;
+	if ((flags & TLB_FLUSH_VA) && !nr_super)
+		first = last = vpn % TLB_SETS;
+	for (set = first; set <= last; set++) {
+		for (i = 0, e = tlb[set]; i < TLB_WAYS; i++, e++) {
+			if (!tlb_flush_match(e, vpn, asid, flags))
+				continue;
+			if (e->super)
+				nr_super--;
+			e->tag = 0;
+			++stats.flushed;
+		}
+	}
+}
+
+void tlb_snapshot(struct tlb_stats *st)
+{
+	*st = stats;
+}
+
+void tlb_stats_reset(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+void tlb_dump(void)
+{
+	uint64_t lookups = stats.hits + stats.misses;
+	int i;
+
+	ESP_LOGI(TAG, "hits: %llu misses: %llu (%llu.%02llu%% hits), walks filled: %llu",
+		 (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+		 (unsigned long long)(lookups ? stats.hits * 100 / lookups : 0),
+		 (unsigned long long)(lookups ? stats.hits * 10000 / lookups % 100 : 0),
+		 (unsigned long long)stats.fills);
+	ESP_LOGI(TAG, "PTE reads: %llu evictions: %llu flushes: %llu dropping %llu entries",
+		 (unsigned long long)stats.pte_reads, (unsigned long long)stats.evictions,
+		 (unsigned long long)stats.flushes, (unsigned long long)stats.flushed);
+	for (i = 0; i < TLB_LAT_BUCKETS; i++) {
+		if (stats.walk_lat[i])
+			ESP_LOGI(TAG, "walk latency %7lu-%7lu ticks: %"PRIu32,
+				 1ul << i, (2ul << i) - 1, stats.walk_lat[i]);
+	}
+}
@@ -0,0 +1,39 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef TLB_H
+#define TLB_H
+
+#include <stdint.h>
+
+#define TLB_SETS		64
+#define TLB_WAYS		4
+
+/* tlb_flush() flags, as rs1 and rs2 of SFENCE.VMA being other than x0 */
+#define TLB_FLUSH_VA		1	/* only the translations of va */
+#define TLB_FLUSH_ASID		2	/* only the non-global ones of asid */
+
+/* walk latency bucket i counts walks done in [2^i, 2^(i+1)) ticks */
+#define TLB_LAT_BUCKETS		16
+
+struct tlb_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t fills;			/* misses whose walk found a translation */
+	uint64_t pte_reads;		/* by walks, through the cache */
+	uint64_t evictions;		/* valid entries replaced by fills */
+	uint64_t flushes;		/* tlb_flush() calls */
+	uint64_t flushed;		/* entries dropped by them */
+	uint32_t walk_lat[TLB_LAT_BUCKETS];
+};
+
+int tlb_lookup(uint32_t va, uint32_t asid, uint32_t *pte);
+void tlb_fill(uint32_t va, uint32_t asid, uint32_t pte, int super);
+void tlb_flush(uint32_t va, uint32_t asid, int flags);
+uint32_t tlb_pte_load(uint32_t ofs);
+void tlb_snapshot(struct tlb_stats *st);
+void tlb_stats_reset(void);
+void tlb_dump(void);
+
+#endif /* TLB_H */
@@ -0,0 +1,160 @@
+/*
+ * Working set size of the guest.
+ *
+ * The cache sets a reference bit for the page of every access. Every
+ * WSS_PERIOD_US the bits are collected and cleared, and each page gets the
+ * number of periods since it was last referenced, its age. The working set
+ * over a window is the number of pages younger than the window.
+ *
+ * The ages double as a reuse distance estimator: when a page of age a is
+ * referenced again, the pages younger than a are the distinct pages touched
+ * since its last use, the LRU stack distance of the reuse at page and period
+ * granularity. A cache of n pages would have served the reuses of distance
+ * below n.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "cache.h"
+#include "wss.h"
+
+#define TAG "wss"
+
+#define WSS_PERIOD_US		250000
+#define WSS_PERIODS(s)		((s) * 1000000 / WSS_PERIOD_US)
+/* not referenced for a minute and more, or never */
+#define WSS_AGE_COLD		255
+
+static const uint32_t windows[WSS_NR_WINDOWS] = {
+	[WSS_1S]	= WSS_PERIODS(1),
+	[WSS_10S]	= WSS_PERIODS(10),
+	[WSS_60S]	= WSS_PERIODS(60),
+};
+
+static const char *const window_names[WSS_NR_WINDOWS] = {
+	[WSS_1S]	= "1s",
+	[WSS_10S]	= "10s",
+	[WSS_60S]	= "60s",
+};
+
+static uint8_t age[CACHE_PAGES];
+static uint8_t refs[CACHE_PAGES / 8];
+/* pages of each age, as of the last period */
+static uint32_t age_pages[WSS_AGE_COLD + 1];
+static struct wss_stats stats;
+static int64_t next_us;
+static int disabled;
+
+static int reuse_bucket(uint32_t dist)
+{
+	int b = dist ? 32 - __builtin_clz(dist) : 0;
+
+	return b < WSS_REUSE_BUCKETS ? b : WSS_REUSE_BUCKETS - 1;
+}
+
+static void wss_sample(void)
+{
+	/* below[a] is the number of pages younger than a */
+	static uint32_t below[WSS_AGE_COLD + 1];
+	uint32_t pg, n = 0;
+	int a, w;
+
+	if (cache_collect_refs(refs)) {
+		disabled = 1;
+		return;
+	}
+
+	for (a = 0; a <= WSS_AGE_COLD; a++) {
+		below[a] = n;
+		n += age_pages[a];
+	}
+	memset(age_pages, 0, sizeof(age_pages));
+
+	for (pg = 0; pg < CACHE_PAGES; pg++) {
+		a = age[pg];
+		if (refs[pg / 8] & (1 << (pg % 8))) {
+			if (a == WSS_AGE_COLD)
+				++stats.reuse_cold;
+			else
+				++stats.reuse[reuse_bucket(below[a])];
+			a = 0;
+		} else if (a < WSS_AGE_COLD) {
+			a++;
+		}
+		age[pg] = a;
+		age_pages[a]++;
+	}
+
+	for (w = 0; w < WSS_NR_WINDOWS; w++) {
+		for (n = 0, a = 0; a < windows[w]; a++)
+			n += age_pages[a];
+		stats.pages[w] = n;
+	}
+	++stats.samples;
+}
+
+/* Called between two slices of guest execution, samples once per period. */
+void wss_tick(void)
+{
+	int64_t now = esp_timer_get_time();
+
+	if (now < next_us || disabled)
+		return;
+	if (!next_us)
+		wss_reset();
+	next_us = now + WSS_PERIOD_US;
+	wss_sample();
+}
+
+void wss_snapshot(struct wss_stats *st)
+{
+	*st = stats;
+}
+
+/* Forget the history, all pages start out cold. */
+void wss_reset(void)
+{
+	memset(age, WSS_AGE_COLD, sizeof(age));
+	memset(age_pages, 0, sizeof(age_pages));
+	age_pages[WSS_AGE_COLD] = CACHE_PAGES;
+	memset(&stats, 0, sizeof(stats));
+	cache_collect_refs(refs);
+}
+
+void wss_dump(void)
+{
+	uint64_t total = 0, cum = 0;
+	int i;
+
+	if (disabled) {
+		ESP_LOGI(TAG, "page reference bits not built in");
+		return;
+	}
+	for (i = 0; i < WSS_NR_WINDOWS; i++)
+		ESP_LOGI(TAG, "working set %s: %"PRIu32" pages, %"PRIu32" KiB",
+			 window_names[i], stats.pages[i],
+			 stats.pages[i] << (CACHE_REGION_SHIFT - 10));
+
+	for (i = 0; i < WSS_REUSE_BUCKETS; i++)
+		total += stats.reuse[i];
+	ESP_LOGI(TAG, "page reuses: %llu, cold touches: %llu, over %"PRIu32" samples",
+		 total, stats.reuse_cold, stats.samples);
+	for (i = 0; i < WSS_REUSE_BUCKETS; i++) {
+		cum += stats.reuse[i];
+		if (!stats.reuse[i])
+			continue;
+		if (i == WSS_REUSE_BUCKETS - 1)
+			ESP_LOGI(TAG, "reuse distance %5lu+      pages: %llu",
+				 1ul << i >> 1, stats.reuse[i]);
+		else
+			ESP_LOGI(TAG, "reuse distance %5lu-%5lu pages: %llu (%llu%% within)",
+				 1ul << i >> 1, (1ul << i) - 1, stats.reuse[i], cum * 100 / total);
+	}
+}
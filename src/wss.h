@@ -0,0 +1,36 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef WSS_H
+#define WSS_H
+
+#include <stdint.h>
+
+/* working set windows */
+enum wss_window {
+	WSS_1S,
+	WSS_10S,
+	WSS_60S,
+	WSS_NR_WINDOWS,
+};
+
+/*
+ * Page reuses by distance: 0 in the first bucket, then 2^(i-1) to 2^i - 1
+ * pages in bucket i. The last one is open ended.
+ */
+#define WSS_REUSE_BUCKETS	12
+
+struct wss_stats {
+	uint32_t pages[WSS_NR_WINDOWS];		/* touched within each window */
+	uint32_t samples;			/* periods sampled */
+	uint64_t reuse[WSS_REUSE_BUCKETS];	/* page reuses by distance */
+	uint64_t reuse_cold;			/* first touches, or after a minute */
+};
+
+void wss_tick(void);
+void wss_snapshot(struct wss_stats *st);
+void wss_reset(void);
+void wss_dump(void);
+
+#endif /* WSS_H */
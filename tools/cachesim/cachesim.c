@@ -0,0 +1,231 @@
+/*
+ * Replay guest memory access traces through src/cache.c on the host.
+ *
+ * The cache geometry is fixed at build time, so build one binary per
+ * geometry (sweep.sh does that for a whole range of them):
+ *
+ *   cc -O2 -DCACHE_SETS=64 -DCACHE_WAYS=2 -DCACHE_LINE_SHIFT=5 \
+ *      -DCACHE_STATS_3C=1 -I../../src -o cachesim cachesim.c ../../src/cache.c
+ *
+ * Traces are captured from firmware built with -DCACHE_TRACE after the guest
+ * writes 2 to CSR 0x13a; every "@<kind><size> <offset>" line of the console
+ * log is one access, anything else is ignored.
+ *
+ *   cachesim [-p policy] [-H] trace...
+ *
+ * Each replacement policy is replayed in its own process, so all of them run
+ * in parallel. One tab separated line is printed per policy, with a header
+ * unless -H is given.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "cache.h"
+#include "psram.h"
+
+struct access {
+	uint32_t ofs;
+	uint8_t kind;
+	uint8_t size;
+};
+
+static struct access *trace;
+static size_t nr_trace;
+
+/* The data never matters here, only the traffic cache.c generates. */
+int psram_init(void)
+{
+	return 0;
+}
+
+int psram_read(uint32_t addr, void *buf, int len)
+{
+	return 0;
+}
+
+int psram_write(uint32_t addr, void *buf, int len)
+{
+	return 0;
+}
+
+static void load_trace(const char *path)
+{
+	static size_t cap;
+	char line[128], kind;
+	unsigned int size;
+	unsigned long ofs;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "@%c%u %lx", &kind, &size, &ofs) != 3)
+			continue;
+		/* cache block operations cover a whole block, at any line size */
+		if (!strchr("rwxaicfz", kind) || size == 0 ||
+		    (size > CACHE_LINE_SIZE && strchr("rwxa", kind)) || size > UINT8_MAX)
+			continue;
+		if (nr_trace == cap) {
+			cap = cap ? cap * 2 : 1 << 16;
+			trace = realloc(trace, cap * sizeof(*trace));
+			if (!trace) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		trace[nr_trace].ofs = ofs;
+		trace[nr_trace].kind = kind;
+		trace[nr_trace].size = size;
+		nr_trace++;
+	}
+	fclose(f);
+}
+
+static void replay(int pol)
+{
+	uint8_t buf[CACHE_LINE_SIZE];
+	struct cache_stats st;
+	uint64_t accesses = 0, misses = 0;
+	char out[256], name[32];
+	size_t i;
+	int n;
+
+	cache_set_policy(pol);
+	memset(buf, 0, sizeof(buf));
+
+	for (i = 0; i < nr_trace; i++) {
+		struct access *a = &trace[i];
+
+		switch (a->kind) {
+		case 'r':
+			cache_read(a->ofs, buf, a->size);
+			break;
+		case 'w':
+			cache_write(a->ofs, buf, a->size);
+			break;
+		case 'x':
+			cache_fetch(a->ofs, buf, a->size);
+			break;
+		case 'a':
+			cache_rmw(a->ofs & ~3u, CACHE_RMW_SWAP, 0, 0);
+			break;
+		case 'i':
+			cache_cbo(a->ofs, a->size, CACHE_CBO_INVAL);
+			break;
+		case 'c':
+			cache_cbo(a->ofs, a->size, CACHE_CBO_CLEAN);
+			break;
+		case 'f':
+			cache_cbo(a->ofs, a->size, CACHE_CBO_FLUSH);
+			break;
+		case 'z':
+			cache_cbo(a->ofs, a->size, CACHE_CBO_ZERO);
+			break;
+		}
+	}
+
+	cache_stats_snapshot(&st);
+	for (i = 0; i < CACHE_NR_ACCESS; i++) {
+		accesses += st.accesses[i];
+		misses += st.misses[i];
+	}
+
+	/* show what set dueling ended up with */
+	if (pol == CACHE_POLICY_DUEL)
+		snprintf(name, sizeof(name), "%s(%s)", cache_policy_name(pol),
+			 cache_policy_name(cache_policy_winner()));
+	else
+		snprintf(name, sizeof(name), "%s", cache_policy_name(pol));
+
+	n = snprintf(out, sizeof(out),
+		     "%u\t%u\t%u\t%s\t%llu\t%.2f\t%llu\t%llu\t%llu\t%llu\t%llu\t%.2f\n",
+		     CACHE_SETS * CACHE_WAYS * CACHE_LINE_SIZE, CACHE_LINE_SIZE,
+		     CACHE_WAYS, name,
+		     (unsigned long long)accesses,
+		     accesses ? 100.0 * (accesses - misses) / accesses : 0.0,
+		     (unsigned long long)st.compulsory,
+		     (unsigned long long)st.conflict,
+		     (unsigned long long)st.capacity,
+		     (unsigned long long)st.bytes_read / 1024,
+		     (unsigned long long)st.bytes_written / 1024,
+		     accesses ? (double)(st.bytes_read + st.bytes_written) / accesses : 0.0);
+	/* a single write so that lines from parallel runs don't interleave */
+	if (write(STDOUT_FILENO, out, n) != n)
+		exit(1);
+}
+
+static void usage(const char *prog)
+{
+	int i;
+
+	fprintf(stderr, "usage: %s [-p policy] [-H] trace...\npolicies:", prog);
+	for (i = 0; i < CACHE_NR_POLICIES; i++)
+		fprintf(stderr, " %s", cache_policy_name(i));
+	fprintf(stderr, "\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, i, pol = -1, header = 1, status, ret = 0;
+
+	while ((opt = getopt(argc, argv, "p:H")) != -1) {
+		switch (opt) {
+		case 'p':
+			for (i = 0; i < CACHE_NR_POLICIES; i++) {
+				if (!strcmp(optarg, cache_policy_name(i)))
+					pol = i;
+			}
+			if (pol < 0)
+				usage(argv[0]);
+			break;
+		case 'H':
+			header = 0;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+
+	for (i = optind; i < argc; i++)
+		load_trace(argv[i]);
+
+	if (header)
+		printf("size\tline\tways\tpolicy\taccesses\thit%%\tcompulsory\tconflict\tcapacity\tread_KiB\twritten_KiB\tbytes/access\n");
+	fflush(stdout);
+
+	if (pol >= 0) {
+		replay(pol);
+		return 0;
+	}
+
+	for (i = 0; i < CACHE_NR_POLICIES; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0) {
+			replay(i);
+			_exit(0);
+		}
+	}
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+	}
+	return ret;
+}
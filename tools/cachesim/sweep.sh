@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Replay traces through every combination of cache size, line size,
+# associativity and replacement policy, using all host cores, and print a
+# table sorted by hit rate.
+#
+#   tools/cachesim/sweep.sh trace...
+#
+# SIZES, LINES and WAYS override the geometries swept, CC and CFLAGS the
+# compiler (e.g. CFLAGS=-DCACHE_WRITE_VALIDATE=0 or CFLAGS=-DCACHE_INDEX=2 to
+# compare cache.c options).
+#
+# SPDX-License-Identifier: BSD-3-Clause
+
+set -e
+
+[ $# -gt 0 ] || { echo "usage: $0 trace..." >&2; exit 2; }
+
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT INT TERM
+
+: "${CC:=cc}"
+: "${SIZES:=2048 4096 8192 16384}"
+: "${LINES:=16 32 64 128}"
+: "${WAYS:=1 2 4 8}"
+jobs=$(nproc 2>/dev/null || getconf _NPROCESSORS_ONLN 2>/dev/null || echo 4)
+
+cat "$@" > "$work/trace"
+
+for size in $SIZES; do
+	for line in $LINES; do
+		for ways in $WAYS; do
+			sets=$((size / line / ways))
+			[ "$sets" -ge 1 ] || continue
+			shift=0
+			while [ $((1 << shift)) -lt "$line" ]; do
+				shift=$((shift + 1))
+			done
+			echo "$sets $shift $ways"
+		done
+	done
+done > "$work/geometries"
+
+export CC CFLAGS here work
+xargs -P "$jobs" -L 1 sh -c '
+	exec $CC -O2 -DCACHE_STATS_3C=1 $CFLAGS -DCACHE_SETS=$0 -DCACHE_LINE_SHIFT=$1 -DCACHE_WAYS=$2 \
+		-I"$here/../../src" -o "$work/sim-$0-$1-$2" \
+		"$here/cachesim.c" "$here/../../src/cache.c"' < "$work/geometries"
+
+# one job per (geometry, policy) pair
+set -- "$work"/sim-*
+policies=$("$1" 2>&1 | sed -n 's/^policies: //p')
+for sim in "$work"/sim-*; do
+	for pol in $policies; do
+		echo "$sim $pol"
+	done
+done | xargs -P "$jobs" -L 1 sh -c 'exec "$0" -H -p "$1" "$work/trace"' > "$work/results"
+
+{
+	printf 'size\tline\tways\tpolicy\taccesses\thit%%\tcompulsory\tconflict\tcapacity\tread_KiB\twritten_KiB\tbytes/access\n'
+	sort -t "$(printf '\t')" -k6,6nr -k12,12n "$work/results"
+} | if command -v column >/dev/null; then column -t -s "$(printf '\t')"; else cat; fi
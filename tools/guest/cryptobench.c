@@ -0,0 +1,157 @@
+/*
+ * Bare metal guest comparing SHA-256 in software with the crypto offload
+ * device at CRYPTODEV_BASE.
+ *
+ *   riscv64-unknown-elf-gcc -march=rv32ima -mabi=ilp32 -O2 -ffreestanding \
+ *      -nostdlib -I../../src -T guest.ld -o cryptobench.elf cryptobench.c
+ *   riscv64-unknown-elf-objcopy -O binary cryptobench.elf cryptobench.bin
+ *
+ * then flash cryptobench.bin where the kernel image goes. Both digests and
+ * the mtime ticks taken by each side are printed on the UART, and the guest
+ * powers off so the firmware dumps the device statistics as well.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+
+#include "cryptodev.h"
+#include "guest.h"
+
+#define BUF_SIZE	(64 * 1024)
+#define ROUNDS		8
+
+#define ROR(x, n)	((x) >> (n) | (x) << (32 - (n)))
+
+static const uint32_t k256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256_block(uint32_t h[8], const uint8_t *p)
+{
+	uint32_t w[64], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ w[i - 15] >> 3) +
+		       (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ w[i - 2] >> 10);
+	for (i = 0; i < 8; i++)
+		s[i] = h[i];
+	for (i = 0; i < 64; i++) {
+		t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) +
+		     ((s[4] & s[5]) ^ (~s[4] & s[6])) + k256[i] + w[i];
+		t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) +
+		     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		s[7] = s[6];
+		s[6] = s[5];
+		s[5] = s[4];
+		s[4] = s[3] + t1;
+		s[3] = s[2];
+		s[2] = s[1];
+		s[1] = s[0];
+		s[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		h[i] += s[i];
+}
+
+static void sha256(const uint8_t *buf, uint32_t len, uint8_t digest[32])
+{
+	uint32_t h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	uint8_t tail[128] = { 0 };
+	uint32_t i, n = len & ~63, rest = len - n, bits = len * 8;
+
+	for (i = 0; i < n; i += 64)
+		sha256_block(h, buf + i);
+	memcpy(tail, buf + n, rest);
+	tail[rest] = 0x80;
+	n = rest < 56 ? 64 : 128;
+	for (i = 0; i < 4; i++)
+		tail[n - 1 - i] = bits >> (8 * i);
+	sha256_block(h, tail);
+	if (n == 128)
+		sha256_block(h, tail + 64);
+	for (i = 0; i < 32; i++)
+		digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+static uint8_t buf[BUF_SIZE];
+static struct cryptodev_desc desc;
+
+static int offload_sha256(const uint8_t *src, uint32_t len, uint8_t digest[32])
+{
+	desc.op = CRYPTODEV_SHA256;
+	desc.src = (uintptr_t)src;
+	desc.len = len;
+	desc.dst = (uintptr_t)digest;
+	REG32(CRYPTODEV_BASE + CRYPTODEV_DESC) = (uintptr_t)&desc;
+	while (REG32(CRYPTODEV_BASE + CRYPTODEV_STATUS) == CRYPTODEV_BUSY)
+		;
+	return REG32(CRYPTODEV_BASE + CRYPTODEV_STATUS);
+}
+
+static void report(const char *name, const uint8_t digest[32], uint32_t ticks)
+{
+	uart_puts(name);
+	uart_puthex(digest, 32);
+	uart_puts(" ");
+	uart_putdec(ticks);
+	uart_puts(" ticks for ");
+	uart_putdec(ROUNDS * BUF_SIZE / 1024);
+	uart_puts(" KiB\n");
+}
+
+int main(void)
+{
+	uint8_t sw[32], hw[32];
+	uint32_t t, sw_ticks, hw_ticks, x = 1;
+	int i, ret = 0;
+
+	for (i = 0; i < BUF_SIZE; i++) {
+		x = x * 1103515245 + 12345;
+		buf[i] = x >> 16;
+	}
+
+	if (REG32(CRYPTODEV_BASE + CRYPTODEV_ID) != CRYPTODEV_MAGIC) {
+		uart_puts("no crypto device\n");
+		return 1;
+	}
+
+	t = mtime();
+	for (i = 0; i < ROUNDS; i++)
+		sha256(buf, BUF_SIZE, sw);
+	sw_ticks = mtime() - t;
+
+	t = mtime();
+	for (i = 0; i < ROUNDS && !ret; i++)
+		ret = offload_sha256(buf, BUF_SIZE, hw);
+	hw_ticks = mtime() - t;
+
+	report("sha256 software ", sw, sw_ticks);
+	if (ret) {
+		uart_puts("sha256 offload failed, status ");
+		uart_putdec(ret);
+		uart_puts("\n");
+		return 1;
+	}
+	report("sha256 offload  ", hw, hw_ticks);
+	for (i = 0; i < 32 && sw[i] == hw[i]; i++)
+		;
+	uart_puts(i == 32 ? "digests match, " : "DIGESTS DIFFER, ");
+	uart_putdec(hw_ticks ? sw_ticks / hw_ticks : 0);
+	uart_puts("x faster\n");
+	return 0;
+}
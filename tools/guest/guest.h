@@ -0,0 +1,104 @@
+/*
+ * Start up code and console helpers shared by the bare metal guests. Each
+ * guest is a single C file including this once.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef GUEST_H
+#define GUEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UART_THR	0x10000000
+#define CLINT_MTIME	0x1100bff8
+#define SYSCON		0x11100000
+#define SYSCON_POWEROFF	0x5555
+
+#define REG32(a)	(*(volatile uint32_t *)(uintptr_t)(a))
+
+__asm__(
+	".section .text.entry, \"ax\"\n"
+	".globl _start\n"
+	"_start:\n"
+	"	la sp, _stack\n"
+	"	la t0, _bss\n"
+	"	la t1, _ebss\n"
+	"1:	bgeu t0, t1, 2f\n"
+	"	sw zero, 0(t0)\n"
+	"	addi t0, t0, 4\n"
+	"	j 1b\n"
+	"2:	call main\n"
+	"	li t0, 0x11100000\n"	/* SYSCON, SYSCON_POWEROFF */
+	"	li t1, 0x5555\n"
+	"	sw t1, 0(t0)\n"
+	"3:	j 3b\n"
+	".previous\n");
+
+/* gcc may call these even with -ffreestanding */
+void *memset(void *s, int c, size_t n)
+{
+	uint8_t *p = s;
+
+	while (n--)
+		*p++ = c;
+	return s;
+}
+
+void *memcpy(void *d, const void *s, size_t n)
+{
+	uint8_t *dp = d;
+	const uint8_t *sp = s;
+
+	while (n--)
+		*dp++ = *sp++;
+	return d;
+}
+
+static inline void uart_putc(char c)
+{
+	REG32(UART_THR) = c;
+}
+
+/* the next console input byte, -1 if there is none */
+static inline int console_getc(void)
+{
+	int c;
+
+	__asm__ volatile("csrr %0, 0xcc0" : "=r"(c));
+	return c;
+}
+
+static inline void uart_puts(const char *s)
+{
+	while (*s)
+		uart_putc(*s++);
+}
+
+static inline void uart_putdec(uint32_t v)
+{
+	char buf[11], *p = buf + sizeof(buf);
+
+	*--p = 0;
+	do
+		*--p = '0' + v % 10;
+	while (v /= 10);
+	uart_puts(p);
+}
+
+static inline void uart_puthex(const uint8_t *b, int n)
+{
+	while (n--) {
+		uart_putc("0123456789abcdef"[*b >> 4]);
+		uart_putc("0123456789abcdef"[*b++ & 15]);
+	}
+}
+
+/* in ticks of the timebase-frequency of dtb.dts */
+static inline uint32_t mtime(void)
+{
+	return REG32(CLINT_MTIME);
+}
+
+#endif /* GUEST_H */
@@ -0,0 +1,83 @@
+/*
+ * Intrinsics for Xpsimd, the packed SIMD extension of the emulator on the
+ * custom-0 opcode (see MiniRV32PSIMD() in src/emulator.h for the encoding).
+ *
+ * The eight 128-bit registers v0..v7 aren't known to the compiler, so they
+ * are named by number and every intrinsic is a volatile asm statement,
+ * which keeps them in program order. Only .insn is needed from the
+ * assembler, binutils 2.30 and LLVM 14 have it.
+ *
+ *	pv_lq(0, a);			v0 = 16 bytes at a, any alignment
+ *	pv_lq(1, b);
+ *	pv_adds(PV_E16, 2, 0, 1);	v2 = v0 + v1, 8 saturating int16_t
+ *	pv_sq(2, dst);
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef PSIMD_H
+#define PSIMD_H
+
+#include <stdint.h>
+
+/* lane widths */
+#define PV_E8		0
+#define PV_E16		1
+#define PV_E32		2
+
+/* funct3 010 ops */
+#define PV_ADD		0
+#define PV_SUB		1
+#define PV_MUL		2	/* low half of the product */
+#define PV_MAC		3	/* vd += vs1 * vs2 */
+#define PV_ADDS		4	/* signed saturating */
+#define PV_SUBS		5
+#define PV_ADDUS	6	/* unsigned saturating */
+#define PV_SUBUS	7
+
+/* funct3 011 ops */
+#define PV_SPLAT	0
+#define PV_REDSUM	1
+
+#define PV_BYTES	16
+
+/* "x<n>", the field .insn puts register n in, n may be a macro */
+#define __PV_STR(n)	#n
+#define __PV_X(n)	"x" __PV_STR(n)
+
+#define pv_lq(vd, p)							\
+	__asm__ volatile(".insn i 0x0b, 0, " __PV_X(vd) ", 0(%0)"	\
+			 : : "r"(p) : "memory")
+
+#define pv_sq(vs, p)							\
+	__asm__ volatile(".insn s 0x0b, 1, " __PV_X(vs) ", 0(%0)"	\
+			 : : "r"(p) : "memory")
+
+#define pv_op(op, w, vd, vs1, vs2)					\
+	__asm__ volatile(".insn r 0x0b, 2, %0, " __PV_X(vd) ", "	\
+			 __PV_X(vs1) ", " __PV_X(vs2) : : "i"((op) << 2 | (w)))
+
+#define pv_add(w, vd, vs1, vs2)		pv_op(PV_ADD, w, vd, vs1, vs2)
+#define pv_sub(w, vd, vs1, vs2)		pv_op(PV_SUB, w, vd, vs1, vs2)
+#define pv_mul(w, vd, vs1, vs2)		pv_op(PV_MUL, w, vd, vs1, vs2)
+#define pv_mac(w, vd, vs1, vs2)		pv_op(PV_MAC, w, vd, vs1, vs2)
+#define pv_adds(w, vd, vs1, vs2)	pv_op(PV_ADDS, w, vd, vs1, vs2)
+#define pv_subs(w, vd, vs1, vs2)	pv_op(PV_SUBS, w, vd, vs1, vs2)
+#define pv_addus(w, vd, vs1, vs2)	pv_op(PV_ADDUS, w, vd, vs1, vs2)
+#define pv_subus(w, vd, vs1, vs2)	pv_op(PV_SUBUS, w, vd, vs1, vs2)
+
+/* every lane of vd = the low bits of x */
+#define pv_splat(w, vd, x)						\
+	__asm__ volatile(".insn r 0x0b, 3, %0, " __PV_X(vd) ", %1, x0"	\
+			 : : "i"(PV_SPLAT << 2 | (w)), "r"(x))
+
+/* the sum of the signed lanes of vs, modulo 2^32 */
+#define pv_redsum(w, vs)						\
+	({								\
+		int32_t __sum;						\
+		__asm__ volatile(".insn r 0x0b, 3, %1, %0, " __PV_X(vs) ", x0" \
+				 : "=r"(__sum) : "i"(PV_REDSUM << 2 | (w))); \
+		__sum;							\
+	})
+
+#endif /* PSIMD_H */
@@ -0,0 +1,163 @@
+/*
+ * Bare metal guest timing typical audio and image loops element by element
+ * against Xpsimd (psimd.h).
+ *
+ *   riscv64-unknown-elf-gcc -march=rv32ima -mabi=ilp32 -O2 -ffreestanding \
+ *      -nostdlib -T guest.ld -o psimdbench.elf psimdbench.c
+ *   riscv64-unknown-elf-objcopy -O binary psimdbench.elf psimdbench.bin
+ *
+ * then flash psimdbench.bin where the kernel image goes. Each loop prints
+ * the mtime ticks of both versions, and whether their results agree.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+
+#include "guest.h"
+#include "psimd.h"
+
+#define SAMPLES		(16 * 1024)	/* a multiple of PV_BYTES in every width */
+#define ROUNDS		4
+
+static int16_t left[SAMPLES], right[SAMPLES], mix[2][SAMPLES];
+static uint8_t pixels[SAMPLES], bright[2][SAMPLES];
+static int32_t coef[SAMPLES], sig[SAMPLES];
+
+/* mixing two audio streams, clipped */
+static void mix_c(int16_t *dst, const int16_t *a, const int16_t *b)
+{
+	int32_t s;
+	int i;
+
+	for (i = 0; i < SAMPLES; i++) {
+		s = a[i] + b[i];
+		dst[i] = s > INT16_MAX ? INT16_MAX : s < INT16_MIN ? INT16_MIN : s;
+	}
+}
+
+static void mix_pv(int16_t *dst, const int16_t *a, const int16_t *b)
+{
+	int i;
+
+	for (i = 0; i < SAMPLES; i += PV_BYTES / 2) {
+		pv_lq(0, a + i);
+		pv_lq(1, b + i);
+		pv_adds(PV_E16, 2, 0, 1);
+		pv_sq(2, dst + i);
+	}
+}
+
+/* raising the brightness of an 8 bit greyscale image */
+static void bright_c(uint8_t *dst, const uint8_t *src, uint8_t k)
+{
+	int i;
+
+	for (i = 0; i < SAMPLES; i++)
+		dst[i] = src[i] + k > 255 ? 255 : src[i] + k;
+}
+
+static void bright_pv(uint8_t *dst, const uint8_t *src, uint8_t k)
+{
+	int i;
+
+	pv_splat(PV_E8, 1, k);
+	for (i = 0; i < SAMPLES; i += PV_BYTES) {
+		pv_lq(0, src + i);
+		pv_addus(PV_E8, 0, 0, 1);
+		pv_sq(0, dst + i);
+	}
+}
+
+/* an FIR filter tap, or any other dot product */
+static int32_t dot_c(const int32_t *a, const int32_t *b)
+{
+	uint32_t sum = 0;
+	int i;
+
+	/* wrapping like the lanes do */
+	for (i = 0; i < SAMPLES; i++)
+		sum += (uint32_t)a[i] * b[i];
+	return sum;
+}
+
+static int32_t dot_pv(const int32_t *a, const int32_t *b)
+{
+	int i;
+
+	pv_splat(PV_E32, 2, 0);
+	for (i = 0; i < SAMPLES; i += PV_BYTES / 4) {
+		pv_lq(0, a + i);
+		pv_lq(1, b + i);
+		pv_mac(PV_E32, 2, 0, 1);
+	}
+	return pv_redsum(PV_E32, 2);
+}
+
+static int same(const void *a, const void *b, uint32_t len)
+{
+	const uint8_t *x = a, *y = b;
+
+	while (len && *x++ == *y++)
+		len--;
+	return !len;
+}
+
+static void report(const char *name, uint32_t c_ticks, uint32_t pv_ticks, int ok)
+{
+	uart_puts(name);
+	uart_puts(": c ");
+	uart_putdec(c_ticks);
+	uart_puts(", xpsimd ");
+	uart_putdec(pv_ticks);
+	uart_puts(" ticks, ");
+	uart_putdec(pv_ticks ? c_ticks / pv_ticks : 0);
+	uart_puts(ok ? "x faster\n" : "x faster, RESULTS DIFFER\n");
+}
+
+int main(void)
+{
+	uint32_t t, c_ticks, pv_ticks, x = 1;
+	int32_t dot[2];
+	int i, r;
+
+	for (i = 0; i < SAMPLES; i++) {
+		x = x * 1103515245 + 12345;
+		left[i] = x >> 8;
+		right[i] = x >> 16;
+		pixels[i] = x >> 24;
+		coef[i] = (int16_t)(x >> 4);
+		sig[i] = (int16_t)(x >> 12);
+	}
+
+	t = mtime();
+	for (r = 0; r < ROUNDS; r++)
+		mix_c(mix[0], left, right);
+	c_ticks = mtime() - t;
+	t = mtime();
+	for (r = 0; r < ROUNDS; r++)
+		mix_pv(mix[1], left, right);
+	pv_ticks = mtime() - t;
+	report("int16 mix", c_ticks, pv_ticks, same(mix[0], mix[1], sizeof(mix[0])));
+
+	t = mtime();
+	for (r = 0; r < ROUNDS; r++)
+		bright_c(bright[0], pixels, 40);
+	c_ticks = mtime() - t;
+	t = mtime();
+	for (r = 0; r < ROUNDS; r++)
+		bright_pv(bright[1], pixels, 40);
+	pv_ticks = mtime() - t;
+	report("uint8 brightness", c_ticks, pv_ticks, same(bright[0], bright[1], sizeof(bright[0])));
+
+	t = mtime();
+	for (r = 0; r < ROUNDS; r++)
+		dot[0] = dot_c(coef, sig);
+	c_ticks = mtime() - t;
+	t = mtime();
+	for (r = 0; r < ROUNDS; r++)
+		dot[1] = dot_pv(coef, sig);
+	pv_ticks = mtime() - t;
+	report("int32 dot product", c_ticks, pv_ticks, dot[0] == dot[1]);
+	return 0;
+}